@@ -1,23 +1,41 @@
+#if defined(__linux__)
+/* For splice(2), mremap(2) and O_TMPFILE */
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "fw.h"
+#include "trace.h"
 
 /* Events to fire for an event, this is non exhaustive */
 typedef struct fwEvt {
     int fd;
+    /* What the OS calls the watch, an inotify wd or the fd kqueue watches */
+    int wd;
     /* Events mask */
     int mask;
     /* Callback to invoke for the watched file */
@@ -26,45 +44,377 @@ typedef struct fwEvt {
     void *data;
 } fwEvt;
 
+/* Maximum number of batch subscribers per loop */
+#define FW_BATCH_SUBS_MAX 8
+
+typedef struct fwBatchSub {
+    fwBatchCallback *cb;
+    void *data;
+} fwBatchSub;
+
+/* Interest in a plain filedescriptor that is not being watched as a file */
+typedef struct fwIo {
+    /* FW_IO_* mask, 0 if the fd is not registered */
+    int mask;
+    fwIoCallback *cb;
+    void *data;
+} fwIo;
+
+/* What to do with a signal read by the loop, a NULL callback stops it */
+typedef struct fwSignal {
+    fwSignalCallback *cb;
+    void *data;
+} fwSignal;
+
+typedef struct fwDaemon fwDaemon;
+typedef struct fwOutput fwOutput;
+
+/* Longest line handed to the line callback, longer lines are split */
+#define FW_LINE_MAX 4096
+
+/* Bounded history of one output stream of a job */
+typedef struct fwRing {
+    char *buf;
+    size_t size;
+    /* Bytes ever written, the ring holds the last 'size' of them */
+    unsigned long long total;
+    /* Bytes that were overwritten or could not be written */
+    unsigned long long dropped;
+} fwRing;
+
+/* The read end of a job's stdout or stderr */
+typedef struct fwStream {
+    /* -1 once the job has closed its end and we have drained ours */
+    int fd;
+    pid_t pid;
+    int rule;
+    /* FW_STDOUT or FW_STDERR */
+    int stream;
+    fwRing ring;
+    /* The line being framed */
+    char line[FW_LINE_MAX];
+    int line_len;
+    /* Held by the running job and by its rule, freed when both let go */
+    int refs;
+} fwStream;
+
+/* A command and when to run it */
+typedef struct fwRule {
+    /* fnmatch pattern for absolute paths, NULL matches every file */
+    char *pattern;
+    char *command;
+    /* FW_JOB_* */
+    int policy;
+    /* Matching files changed since the last job started */
+    int pending;
+    /* Number of jobs running for this rule */
+    int running;
+    /* Logical clock when the last job started */
+    unsigned long long since;
+    /* Captured output of the latest job, NULL without capture */
+    fwStream *output[2];
+    /* Runs for the targets that depend on what changed, see fwAddDeps */
+    int deps;
+} fwRule;
+
+typedef struct fwJob {
+    /* Also the process group of the job, -1 if the slot is free */
+    pid_t pid;
+    /* Index into rules */
+    int rule;
+    /* Signals the job exiting, -1 if the OS has no pidfd */
+    int pidfd;
+    /* The loop hears about its exit, otherwise it is polled for */
+    int watched;
+    /* 1 once it was sent SIGTERM, 2 once SIGKILL followed at 'kill_at' */
+    int stopping;
+    uint64_t kill_at;
+    /* Captured stdout and stderr, NULL without capture */
+    fwStream *out[2];
+    /* When it was spawned, only set when tracing */
+    uint64_t started;
+    /* Flow of the batch that started it, 0 when not tracing */
+    uint64_t flow;
+} fwJob;
+
+/* Files matching 'pattern' keep a hash per FW_BLOCK_SIZE block */
+typedef struct fwBlockRule {
+    char *pattern;
+    /* FW_BLOCKS_* */
+    int flags;
+} fwBlockRule;
+
+typedef struct fwBlockMap {
+    int flags;
+    /* Size of the file when it was last hashed */
+    long long size;
+    /* Blocks in the file, and how many 'hashes' has room for */
+    size_t count;
+    size_t cap;
+    uint64_t *hashes;
+    /* A bit per block whose hash changed in the last update */
+    uint64_t *dirty;
+    /* Blocks below this have a hash to compare against */
+    size_t valid;
+    /* Next block to compare when a change was too large to hash at once,
+     * the rest is hashed between polls. Equal to 'count' otherwise */
+    size_t next;
+    /* Hand the change to batch subscribers again once 'next' reaches the
+     * end, as only then are the dirty bits known */
+    int report;
+} fwBlockMap;
+
 typedef struct fwFile {
-    /* Filedescriptor */
+    /* Filedescriptor, -1 once the OS no longer needs it */
     int fd;
+    /* Index into the files_array of the owning fwState */
+    int id;
     /* how big the file is */
     long long size;
     /* file last updated time */
     time_t last_update;
     /* Name of the file */
     char *name;
+    /* Logical clock of the last change, 0 if it has not changed */
+    unsigned long long changed_at;
+    /* FW_EVT_* mask of the last change */
+    int changed_mask;
+    /* The file no longer exists, kept so queries can report it */
+    int deleted;
+    /* Neighbours in the list of files ordered by changed_at */
+    struct fwFile *older;
+    struct fwFile *newer;
+    /* Hashes of each block, NULL unless a block rule matches the file */
+    fwBlockMap *blocks;
+    /* Index into fws->deps->files if this is a .d file, otherwise -1 */
+    int dep_file;
+    /* Watch id, -1 while the file does not exist */
+    int wd;
+    /* The inode being watched */
+    dev_t dev;
+    ino_t ino;
 } fwFile;
 
+/* A directory watched for names appearing in it, so a file that was deleted
+ * or renamed away is watched again once it is back */
+typedef struct fwDir {
+    char *path;
+    /* Index into the dirs of the owning fwState */
+    int id;
+    /* Watch id, -1 once the directory itself is gone */
+    int wd;
+    /* Kept open for kqueue, -1 on linux */
+    int fd;
+    /* FW_DIR_* */
+    int flags;
+    /* Suffix new files need to be added, NULL for any */
+    char *ext;
+    int extlen;
+} fwDir;
+
+/* Files appearing in the directory are added, not only known ones */
+#define FW_DIR_FILES 0x1
+/* So are directories, along with everything in them */
+#define FW_DIR_TREE  0x2
+/* New .d files in it and in directories created under it are loaded */
+#define FW_DIR_DEPS  0x4
+
+/* Open addressing from a pair of keys to an id, -1 marks an empty slot. The
+ * size is a power of two and it is kept at most half full */
+typedef struct fwIdSlot {
+    uint64_t a;
+    uint64_t b;
+    int id;
+} fwIdSlot;
+
+typedef struct fwIdMap {
+    fwIdSlot *slots;
+    unsigned int size;
+    unsigned int count;
+} fwIdMap;
+
+/* Ids by name, where the names live is up to the owner of the ids. Ids are
+ * added in order from 0, which is what a rebuild walks */
+typedef struct fwNames {
+    int *slots;
+    unsigned int size;
+    int count;
+} fwNames;
+
+/* A target depending on a node, and the edge of the .d file that says so */
+typedef struct fwDepUse {
+    int target;
+    int file;
+    int edge;
+} fwDepUse;
+
+typedef struct fwDepNode {
+    char *name;
+    /* Node for what the name resolves to, which the watched files are
+     * named by. -1 until it is looked up */
+    int canon;
+    /* Targets depending on this, once for every .d file that says so */
+    fwDepUse *users;
+    int users_count;
+    int users_cap;
+    /* Last fwDeps.query this target was handed out in */
+    unsigned int seen;
+} fwDepNode;
+
+/* One 'target' built from 'dep', 'use' is where it sits in the users of
+ * 'dep' so it can be taken out without a search */
+typedef struct fwDepEdge {
+    int dep;
+    int target;
+    int use;
+} fwDepEdge;
+
+/* What one .d file added to the index, so it can be taken out again */
+typedef struct fwDepFile {
+    fwFile *fw;
+    fwDepEdge *edges;
+    int edges_count;
+    int edges_cap;
+} fwDepFile;
+
+/* Reverse map from a dependency to the targets built from it */
+typedef struct fwDeps {
+    fwDepNode *nodes;
+    int nodes_count;
+    int nodes_cap;
+    /* Node ids by name, open addressing with -1 for empty slots. The size
+     * is a power of two */
+    int *table;
+    unsigned int table_size;
+    fwDepFile *files;
+    int files_count;
+    /* Relative paths in .d files are taken from here */
+    char *base;
+    unsigned int query;
+    /* Targets of the rule being parsed, kept between rules */
+    int *targets;
+    int targets_cap;
+} fwDeps;
+
 typedef struct fwState {
-    /* Maximum number of files we can track */
+    /* Events read per poll and the initial number of watches, both grow */
     int max_events;
-    /* Command to repeatedly run for this context */
-    char *command;
+    /* Commands to run when the files they match change */
+    fwRule *rules;
+    int rules_count;
+    /* Files to keep block maps for */
+    fwBlockRule *block_rules;
+    int block_rules_count;
+    /* Ids of files whose block map is still being hashed */
+    int *blocks_pending;
+    int blocks_pending_count;
+    int blocks_pending_cap;
+    /* Loaded from .d files, NULL until fwAddDeps */
+    fwDeps *deps;
+    /* Rule fwJobsSchedule looks at first */
+    int rule_next;
+    /* Slots for running jobs, pid is -1 if free */
+    fwJob *jobs;
+    int jobs_cap;
+    /* How many jobs may run at once */
+    int max_jobs;
+    int jobs_running;
+    /* Some rule has changes it has not started a job for */
+    int jobs_pending;
+    /* Size of each ring job output is captured in, 0 to not capture */
+    int capture_size;
+    /* Captured output is also written to this file, or -1 */
+    int capture_log;
+    /* Output is teed into this pipe and spliced on to the log, -1 where
+     * tee or splice turn out not to work and it is written instead */
+    int capture_pipe[2];
+    /* Called for each line of captured output */
+    fwLineCallback *line_cb;
+    void *line_data;
     /* How many events have been processed */
     size_t processed_events;
-    /* 1 = run event loop, 0 = stop */
-    int run_loop;
-    /* Current highest open filedescriptor */
-    int fd_current_max;
+    /* Logical clock, advanced for every event that is processed */
+    unsigned long long clock;
+    /* Differs between any two states, so a clock from another process or
+     * an earlier run of this one is never taken for one of ours */
+    unsigned long long instance;
+    /* Changed files, least recently changed first */
+    fwFile *changes_oldest;
+    fwFile *changes_newest;
+    /* 1 = run event loop, 0 = stop. Can be cleared from another thread */
+    volatile int run_loop;
+    /* Set while fwLoopReplay runs, see there for what is left out */
+    int replaying;
+    /* Trace flow of the batch being decoded and dispatched, 0 if none */
+    uint64_t flow;
+    /* A bit per signal another loop read on our behalf, see fwLoopFanSignal */
+    unsigned long long signals_raised;
+    /* Next in the list of every loop in the process */
+    struct fwState *loop_next;
     /* How long to poll for, set to -1 to never stop */
     int poll_timeout;
     /* How many files we are tracking in fws */
     size_t files_count;
     /* How much memory we have for files array */
     size_t files_mem_capacity;
-    /* Array of files */
-    fwFile *files_array;
-    /* Events that are idle */
+    /* Array of files, indexed by fwFile.id */
+    fwFile **files_array;
+    /* File ids by absolute path, and by the inode they watch */
+    fwNames file_names;
+    fwIdMap file_inodes;
+    /* Directories of the files, indexed by fwDir.id, and their ids by path */
+    fwDir **dirs;
+    int dirs_count;
+    fwNames dir_names;
+    /* Watches, indexed by the watch id handed to callbacks */
     fwEvt *idle;
-    /* Events ready */
-    fwEvt *active;
+    int idle_cap;
+    /* Ids of free slots in 'idle' */
+    int *idle_free;
+    int idle_free_count;
+    /* Freed while dispatching, events for them may still be in 'active' so
+     * they only become free once the dispatch is over */
+    int *idle_dead;
+    int idle_dead_count;
+    /* Watch ids by 'fwEvt.wd', inotify never hands a wd out again so events
+     * still queued for a removed watch find nothing */
+    fwIdMap watch_ids;
+    /* The event being dispatched, NULL outside of fwLoopDispatch */
+    fwBatchEvt *event;
+    /* Events ready, duplicates are merged before they are dispatched */
+    fwBatchEvt *active;
+    /* Per watch id, the last index in 'active' for that watch or -1. Only
+     * valid while merging */
+    int *wd_last;
+    /* Per active event, the previous index in 'active' for the same watch */
+    int *wd_prev;
+    /* Length of 'active' and 'wd_prev', and how many are being dispatched */
+    int active_cap;
+    int active_count;
+    /* Callbacks handed every event from a poll at once */
+    fwBatchSub subs[FW_BATCH_SUBS_MAX];
+    /* Plain filedescriptors served by the loop, indexed by fd */
+    fwIo *io;
+    /* Length of 'io' */
+    int io_cap;
+    /* Signals read by the loop and what to do with each */
+    sigset_t sigmask;
+    fwSignal signals[NSIG];
+    /* Set if the loop is serving subscribers over a socket */
+    fwDaemon *daemon;
+    /* Set if events are being written out with fwSetOutput */
+    fwOutput *output;
     /* Allow for OS specific implementation */
-    void *evt_state; 
+    void *evt_state;
 } fwState;
 
-static pid_t child_p = -1;
+/* A set of independent loops, each on its own thread, that a tree is split
+ * across by hashing directory names */
+typedef struct fwShardGroup {
+    int count;
+    fwState **shards;
+    pthread_t *threads;
+} fwShardGroup;
 
 #if defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6) || \
         defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
@@ -117,9 +467,213 @@ static pid_t child_p = -1;
 #define fwEvtWatch(ev, fws, fd, mask) \
     ((ev)->watch((fws), (fd), (ev)->data, (mask)))
 
+static void fwLoopFanSignal(int signo);
+static void fwLoopRunSignals(fwState *fws);
+static void fwDaemonRelease(fwState *fws);
+static void fwOutputRelease(fwState *fws);
+static void fwJobExited(fwState *fws, pid_t pid);
+static void fwJobsSchedule(fwState *fws);
+static void fwJobsStop(fwState *fws);
+static int fwJobsCheck(fwState *fws, int all);
+static int fwJobsTimeout(fwState *fws, int timeout);
+static void fwStreamRelease(fwStream *st);
+static void fwCaptureClose(fwState *fws);
+static void fwBlocksRelease(fwBlockMap *map);
+static void fwBlocksContinue(fwState *fws);
+static void fwDepsRelease(fwDeps *deps);
+static void fwDepsReload(fwState *fws, fwFile *fw);
+static int fwDepsAddFile(fwState *fws, char *path);
+static int fwDepsVisit(char *dirname, void *data);
+static int fwDepsAffects(fwState *fws, fwFile *fw);
+static void fwLoopDispatchIo(fwState *fws, int fd, int mask);
+static void fwLoopDispatch(fwState *fws, int eventcount);
+static void fwListener(fwState *fws, int fd, void *data, int type);
+
+/* Signals that each loop receives as events rather than through a process
+ * wide handler. They are blocked so the OS queues them for the loop */
+static void fwSignalSet(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+}
+
+/*============================================================================
+ * WATCH IDS
+ *============================================================================*/
+
+/* FNV-1a, spreads directories across shards and names across tables */
+static unsigned int fwHashString(char *str, int len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int fwIdHash(uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b * 0x9E3779B97F4A7C15ull)) * 0xBF58476D1CE4E5B9ull;
+    return h ^ (h >> 32);
+}
+
+/* The id for (a, b), -1 if there is none */
+static int fwIdMapGet(fwIdMap *m, uint64_t a, uint64_t b) {
+    unsigned int mask = m->size - 1;
+
+    if (m->size == 0) {
+        return -1;
+    }
+
+    for (unsigned int i = fwIdHash(a, b) & mask; m->slots[i].id != -1;
+         i = (i + 1) & mask) {
+        if (m->slots[i].a == a && m->slots[i].b == b) {
+            return m->slots[i].id;
+        }
+    }
+    return -1;
+}
+
+/* Map (a, b) to 'id', replacing whatever it was mapped to */
+static int fwIdMapPut(fwIdMap *m, uint64_t a, uint64_t b, int id) {
+    fwIdSlot *old = m->slots, *slots;
+    unsigned int old_size = m->size, size, i;
+
+    if ((m->count + 1) * 2 > m->size) {
+        size = m->size ? m->size * 2 : 64;
+        if ((slots = malloc(sizeof(fwIdSlot) * size)) == NULL) {
+            return -1;
+        }
+        for (i = 0; i < size; ++i) {
+            slots[i].id = -1;
+        }
+        m->slots = slots;
+        m->size = size;
+        m->count = 0;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].id != -1) {
+                fwIdMapPut(m, old[i].a, old[i].b, old[i].id);
+            }
+        }
+        free(old);
+    }
+
+    for (i = fwIdHash(a, b) & (m->size - 1); m->slots[i].id != -1;
+         i = (i + 1) & (m->size - 1)) {
+        if (m->slots[i].a == a && m->slots[i].b == b) {
+            m->slots[i].id = id;
+            return 0;
+        }
+    }
+    m->slots[i].a = a;
+    m->slots[i].b = b;
+    m->slots[i].id = id;
+    m->count++;
+    return 0;
+}
+
+/* Entries that probed past the one removed are shifted back into the hole,
+ * so lookups never need tombstones */
+static void fwIdMapDel(fwIdMap *m, uint64_t a, uint64_t b) {
+    unsigned int mask = m->size - 1, i, j, k;
+
+    if (m->size == 0) {
+        return;
+    }
+
+    for (i = fwIdHash(a, b) & mask; m->slots[i].id != -1; i = (i + 1) & mask) {
+        if (m->slots[i].a == a && m->slots[i].b == b) {
+            break;
+        }
+    }
+    if (m->slots[i].id == -1) {
+        return;
+    }
+
+    for (j = (i + 1) & mask; m->slots[j].id != -1; j = (j + 1) & mask) {
+        k = fwIdHash(m->slots[j].a, m->slots[j].b) & mask;
+        /* Its home is cyclically in (i, j], it is already reachable */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        m->slots[i] = m->slots[j];
+        i = j;
+    }
+    m->slots[i].id = -1;
+    m->count--;
+}
+
+typedef const char *fwNameOf(fwState *fws, int id);
+
+static int fwNamesFind(fwState *fws, fwNames *t, fwNameOf *name_of,
+                       const char *name) {
+    unsigned int mask = t->size - 1;
+    int id;
+
+    if (t->size == 0) {
+        return -1;
+    }
+
+    for (unsigned int i = fwHashString((char *)name, strlen(name)) & mask;
+         (id = t->slots[i]) != -1; i = (i + 1) & mask) {
+        if (!strcmp(name_of(fws, id), name)) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+static void fwNamesInsert(fwState *fws, fwNames *t, fwNameOf *name_of,
+                          int id) {
+    const char *name = name_of(fws, id);
+    unsigned int i = fwHashString((char *)name, strlen(name)) & (t->size - 1);
+
+    while (t->slots[i] != -1) {
+        i = (i + 1) & (t->size - 1);
+    }
+    t->slots[i] = id;
+}
+
+/* 'id' has to be the next one, t->count */
+static int fwNamesAdd(fwState *fws, fwNames *t, fwNameOf *name_of, int id) {
+    unsigned int size;
+    int *slots;
+
+    if ((t->count + 1) * 2 > t->size) {
+        size = t->size ? t->size * 2 : 64;
+        if ((slots = malloc(sizeof(int) * size)) == NULL) {
+            return -1;
+        }
+        memset(slots, -1, sizeof(int) * size);
+        free(t->slots);
+        t->slots = slots;
+        t->size = size;
+        for (int i = 0; i < t->count; ++i) {
+            fwNamesInsert(fws, t, name_of, i);
+        }
+    }
+
+    fwNamesInsert(fws, t, name_of, id);
+    t->count++;
+    return 0;
+}
+
+static const char *fwFileName(fwState *fws, int id) {
+    return fws->files_array[id]->name;
+}
+
+static const char *fwDirName(fwState *fws, int id) {
+    return fws->dirs[id]->path;
+}
+
 /** ===========================================================================
  * MAC OS implementation - kqueue
  * ===========================================================================*/
+static uint64_t fwMonotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 #if defined(IS_BSD)
 #include <sys/event.h>
 
@@ -130,12 +684,17 @@ typedef struct fwEvtState {
 
 #define __kevent(kfd, ev) (kevent((kfd), (ev), 1, NULL, 0, NULL))
 
+/* kevent never returns more than we ask it for */
+#define fwLoopBatchSize(max_events) (max_events)
+
 static fwEvtState *fwLoopStateNew(int max_events) {
     fwEvtState *es;
+    struct kevent change;
 
     if ((es = malloc(sizeof(fwEvtState))) == NULL) {
         goto error;
     }
+    es->events = NULL;
 
     if ((es->events = malloc(sizeof(struct kevent) * max_events)) == NULL) {
         goto error;
@@ -147,6 +706,16 @@ static fwEvtState *fwLoopStateNew(int max_events) {
     }
     fwDebug("kqueue() fd=%d\n", es->kfd);
 
+    /* kqueue records signals even though they are blocked */
+    EV_SET(&change, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    __kevent(es->kfd, &change);
+    EV_SET(&change, SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    __kevent(es->kfd, &change);
+
+    /* Used by fwLoopStop to wake the loop up from another thread */
+    EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    __kevent(es->kfd, &change);
+
     return es;
 
 error:
@@ -172,9 +741,27 @@ static int fwLoopStateAdd(fwState *fws, int fd, int mask) {
             return FW_EVT_ERR;
         }
     }
+
+    /* A directory is written to when a name is added, kqueue does not say
+     * which */
+    if (mask & FW_EVT_CREATE) {
+        EV_SET(&change, fd, EVFILT_VNODE, EV_ADD, NOTE_WRITE | NOTE_DELETE, 0,
+               0);
+        if (__kevent(es->kfd, &change) == -1) {
+            return FW_EVT_ERR;
+        }
+    }
     return FW_EVT_OK;
 }
 
+/* Nothing is kept per watch id */
+static int fwLoopStateGrow(fwState *fws, int cap) {
+    return 0;
+}
+
+static void fwLoopStateForget(fwState *fws, int id) {
+}
+
 static void fwLoopStateDelete(fwState *fws, int fd, int mask) {
     fwEvtState *es = fws->evt_state;
     struct kevent event;
@@ -184,40 +771,113 @@ static void fwLoopStateDelete(fwState *fws, int fd, int mask) {
     __kevent(es->kfd, &event);
 }
 
+/* Move 'fd' from the FW_IO_* interest 'oldmask' to 'newmask' */
+static int fwLoopStateIo(fwState *fws, int fd, int oldmask, int newmask) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct kevent change;
+
+    if ((oldmask ^ newmask) & FW_IO_READ) {
+        EV_SET(&change, fd, EVFILT_READ,
+               newmask & FW_IO_READ ? EV_ADD : EV_DELETE, 0, 0, NULL);
+        if (__kevent(es->kfd, &change) == -1) {
+            return FW_EVT_ERR;
+        }
+    }
+
+    if ((oldmask ^ newmask) & FW_IO_WRITE) {
+        EV_SET(&change, fd, EVFILT_WRITE,
+               newmask & FW_IO_WRITE ? EV_ADD : EV_DELETE, 0, 0, NULL);
+        if (__kevent(es->kfd, &change) == -1) {
+            return FW_EVT_ERR;
+        }
+    }
+    return FW_EVT_OK;
+}
+
+/* Start reading 'signo', kqueue records it even though it is blocked */
+static int fwLoopStateSignal(fwState *fws, int signo) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct kevent change;
+
+    EV_SET(&change, signo, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (__kevent(es->kfd, &change) == -1) {
+        return FW_EVT_ERR;
+    }
+    return FW_EVT_OK;
+}
+
+static void fwLoopStateWake(fwState *fws) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct kevent event;
+
+    EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    __kevent(es->kfd, &event);
+}
+
 /* Check for activity on a file descriptor */
 static int fwLoopPoll(fwState *fws) {
     fwEvtState *es = fwLoopGetEvtState(fws);
+    struct timespec ts, *tsp = NULL;
+    /* Block maps still being hashed go on once the poll finds nothing */
+    int timeout = fws->blocks_pending_count
+                          ? 0
+                          : fwJobsTimeout(fws, fws->poll_timeout);
     int fdcount = 0;
+    int j = 0;
+
+    if (timeout != -1) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
 
-    fdcount = kevent(es->kfd, NULL, 0, es->events, fws->max_events, NULL);
+    fdcount = kevent(es->kfd, NULL, 0, es->events, fws->max_events, tsp);
 
     if (fdcount == -1) {
-        return FW_EVT_ERR;
+        return errno == EINTR ? 0 : FW_EVT_ERR;
     }
 
-    if (fdcount > 0) {
-        for (int i = 0; i < fdcount; ++i) {
-            int newmask = 0;
-            struct kevent *change = &es->events[i];
+    for (int i = 0; i < fdcount; ++i) {
+        int newmask = 0, id;
+        struct kevent *change = &es->events[i];
+
+        if (change->filter == EVFILT_SIGNAL) {
+            fwLoopFanSignal(change->ident);
+            continue;
+        } else if (change->filter == EVFILT_USER) {
+            continue;
+        } else if (change->filter == EVFILT_READ) {
+            fwLoopDispatchIo(fws, change->ident, FW_IO_READ);
+            continue;
+        } else if (change->filter == EVFILT_WRITE) {
+            fwLoopDispatchIo(fws, change->ident, FW_IO_WRITE);
+            continue;
+        } else if (change->filter == EVFILT_PROC) {
+            fwJobExited(fws, change->ident);
+            continue;
+        }
 
-            /* These are treated as watch events */
-            if (change->fflags & (NOTE_WRITE | NOTE_EXTEND)) {
-                newmask |= FW_EVT_WATCH;
-            }
+        /* These are treated as watch events */
+        if (change->fflags & (NOTE_WRITE | NOTE_EXTEND)) {
+            newmask |= FW_EVT_WATCH;
+        }
 
-            /* The caller can determine what to do with a delete */
-            if (change->fflags & (NOTE_DELETE)) {
-                newmask |= FW_EVT_DELETE;
-            }
+        /* The caller can determine what to do with a delete */
+        if (change->fflags & (NOTE_DELETE)) {
+            newmask |= FW_EVT_DELETE;
+        }
 
-            fws->active[i].fd = change->ident;
-            fws->active[i].mask = newmask;
+        if ((id = fwIdMapGet(&fws->watch_ids, change->ident, 0)) == -1) {
+            continue;
         }
-    } else if (fdcount == -1) {
-        return FW_EVT_ERR;
+        fws->active[j].wd = id;
+        fws->active[j].mask = newmask;
+        fws->active[j].cookie = 0;
+        fws->active[j].name = "";
+        j++;
     }
 
-    return fdcount;
+    return j;
 }
 
 static void fwEvtStateRelease(fwState *fws) {
@@ -233,22 +893,126 @@ static void fwEvtStateRelease(fwState *fws) {
 
 #elif defined(IS_LINUX)
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
 
 #define EVENT_SIZE    (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
 
+/* The most events a single read of the inotify buffer can produce */
+#define fwLoopBatchSize(max_events) (EVENT_BUF_LEN / EVENT_SIZE)
+
+/* Default bound on raw events held in memory between reading and dispatch */
+#define FW_QUEUE_MAX (1024 * 1024)
+/* Most inotify buffers read per poll, so a storm still lets jobs, signals
+ * and clients be served */
+#define FW_QUEUE_READS 64
+
+/* Raw inotify records read ahead of dispatch, so the kernel queue is
+ * drained faster than callbacks run. Past half of 'max' events without a
+ * name are coalesced per watch instead, last mask wins. Records that cannot
+ * be coalesced go to an unlinked mmap'd file once 'max' is reached */
+typedef struct fwQueue {
+    size_t max;
+    char *mem;
+    size_t mem_cap;
+    size_t head;
+    size_t tail;
+    int spill_fd;
+    char *spill;
+    size_t spill_cap;
+    size_t spill_head;
+    size_t spill_tail;
+    /* One bit per watch descriptor with the mask it last saw */
+    uint64_t *dirty;
+    int *dirty_mask;
+    int dirty_count;
+    int coalescing;
+} fwQueue;
+
 typedef struct fwEvtState {
     int ifd;
     int epollfd;
+    /* Signals for this loop, see fwSignalSet */
+    int sigfd;
+    /* Written to by fwLoopStop to interrupt epoll_wait */
+    int wakefd;
+    /* Last read from inotify, names in fws->active point into it */
+    char *buf;
+    /* Every read is appended here when recording */
+    FILE *trace;
+    uint64_t trace_start;
+    fwQueue queue;
     struct epoll_event *events;
     struct epoll_event *ev;
 } fwEvtState;
 
+static void fwQueueSpillRelease(fwQueue *q) {
+    if (q->spill) {
+        munmap(q->spill, q->spill_cap);
+        q->spill = NULL;
+    }
+    if (q->spill_fd != -1) {
+        close(q->spill_fd);
+        q->spill_fd = -1;
+    }
+    q->spill_cap = q->spill_head = q->spill_tail = 0;
+}
+
+static void fwEvtStateFree(fwEvtState *es) {
+    if (es->epollfd != -1) {
+        close(es->epollfd);
+    }
+    if (es->ifd != -1) {
+        close(es->ifd);
+    }
+    if (es->sigfd != -1) {
+        close(es->sigfd);
+    }
+    if (es->wakefd != -1) {
+        close(es->wakefd);
+    }
+    if (es->trace) {
+        fclose(es->trace);
+    }
+    fwQueueSpillRelease(&es->queue);
+    free(es->queue.mem);
+    free(es->queue.dirty);
+    free(es->queue.dirty_mask);
+    free(es->buf);
+    free(es->events);
+    free(es->ev);
+    free(es);
+}
+
 static fwEvtState *fwLoopStateNew(int max_events) {
     fwEvtState *es;
+    sigset_t sigs;
+    int fds[3];
 
     if ((es = malloc(sizeof(fwEvtState))) == NULL) {
+        return NULL;
+    }
+
+    es->ifd = es->epollfd = es->sigfd = es->wakefd = -1;
+    es->events = NULL;
+    es->ev = NULL;
+    es->trace = NULL;
+    memset(&es->queue, 0, sizeof(fwQueue));
+    es->queue.max = FW_QUEUE_MAX;
+    es->queue.spill_fd = -1;
+
+    if ((es->buf = malloc(EVENT_BUF_LEN)) == NULL) {
+        goto error;
+    }
+
+    if ((es->queue.dirty = calloc((max_events + 63) / 64,
+                                  sizeof(uint64_t))) == NULL) {
+        goto error;
+    }
+
+    if ((es->queue.dirty_mask = malloc(sizeof(int) * max_events)) == NULL) {
         goto error;
     }
 
@@ -260,35 +1024,37 @@ static fwEvtState *fwLoopStateNew(int max_events) {
         goto error;
     }
 
-    if ((es->ifd = inotify_init()) == -1) {
+    if ((es->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        goto error;
+    }
+
+    if ((es->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
         goto error;
     }
 
-    if ((es->epollfd = epoll_create(EPOLL_CLOEXEC)) == -1) {
+    fwSignalSet(&sigs);
+    if ((es->sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
         goto error;
     }
 
-    es->ev->events = EPOLLIN | EPOLLOUT | EPOLLET;
-    es->ev->data.fd = es->ifd;
-    if (epoll_ctl(es->epollfd, EPOLL_CTL_ADD, es->ifd, es->ev) == -1) {
+    if ((es->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
         goto error;
     }
 
+    fds[0] = es->ifd;
+    fds[1] = es->sigfd;
+    fds[2] = es->wakefd;
+    for (int i = 0; i < 3; ++i) {
+        es->ev->events = EPOLLIN;
+        es->ev->data.fd = fds[i];
+        if (epoll_ctl(es->epollfd, EPOLL_CTL_ADD, fds[i], es->ev) == -1) {
+            goto error;
+        }
+    }
 
     return es;
 error:
-    if (es) {
-        free(es);
-    }
-    if (es->ev) {
-        free(es->ev);
-    }
-    if (es->events) {
-        free(es->events);
-    }
-    if (es->ifd != -1) {
-        close(es->ifd);
-    }
+    fwEvtStateFree(es);
     return NULL;
 }
 
@@ -296,7 +1062,7 @@ error:
  */
 static int fwLoopStateAdd(fwState *fws, int fd, int mask) {
     int wfd, len;
-    char abspath[1048], procpath[1048];
+    char abspath[PATH_MAX], procpath[64];
     fwEvtState *es = fwLoopGetEvtState(fws);
     pid_t pid;
     int flags = 0;
@@ -309,7 +1075,7 @@ static int fwLoopStateAdd(fwState *fws, int fd, int mask) {
     len = snprintf(procpath, sizeof(procpath), "/proc/%d/fd/%d", pid, fd);
     procpath[len] = '\0';
 
-    if ((len = readlink(procpath, abspath, sizeof(abspath))) == -1) {
+    if ((len = readlink(procpath, abspath, sizeof(abspath) - 1)) == -1) {
         return FW_EVT_ERR;
     }
     abspath[len] = '\0';
@@ -335,10 +1101,15 @@ static int fwLoopStateAdd(fwState *fws, int fd, int mask) {
         flags |= IN_CLOSE;
     }
 
-    if ((wfd = inotify_add_watch(es->ifd, abspath, flags)) == -1) {
+    if (mask & FW_EVT_CREATE) {
+        flags |= IN_CREATE | IN_MOVED_TO;
+    }
+
+    /* Another name for the same inode shares the wd, leave its mask be */
+    if ((wfd = inotify_add_watch(es->ifd, abspath, flags | IN_MASK_ADD)) ==
+        -1) {
         return FW_EVT_ERR;
     }
-    close(fd);
 
     return wfd;
 }
@@ -349,458 +1120,4681 @@ static void fwLoopStateDelete(fwState *fws, int wfd, int mask) {
     (void)inotify_rm_watch(es->ifd, wfd);
 }
 
-static void fwEvtStateRelease(fwState *fws) {
-    if (fws) {
-        fwEvtState *es = fwLoopGetEvtState(fws);
-        if (es) {
-            epoll_ctl(es->epollfd, EPOLL_CTL_DEL, es->ifd, es->ev);
-            free(es->events);
-            free(es->ev);
-            close(es->epollfd);
-            close(es->ifd);
-            free(es);
-        }
+/* Move 'fd' from the FW_IO_* interest 'oldmask' to 'newmask' */
+static int fwLoopStateIo(fwState *fws, int fd, int oldmask, int newmask) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct epoll_event ev = {0};
+    int op = EPOLL_CTL_MOD;
+
+    if (oldmask == 0) {
+        op = EPOLL_CTL_ADD;
+    } else if (newmask == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+
+    if (newmask & FW_IO_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (newmask & FW_IO_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+
+    if (epoll_ctl(es->epollfd, op, fd, &ev) == -1) {
+        return FW_EVT_ERR;
     }
+    return FW_EVT_OK;
 }
 
-static int fwLoopPoll(fwState *fws) {
+/* The signalfd takes the whole of fws->sigmask, which now has 'signo' */
+static int fwLoopStateSignal(fwState *fws, int signo) {
     fwEvtState *es = fwLoopGetEvtState(fws);
-    fwEvt *evt;
-    struct inotify_event *event;
-    struct epoll_event *change;
-    char event_buffer[EVENT_BUF_LEN];
-    int fdcount = epoll_wait(es->epollfd, es->events, fws->max_events, -1);
-    int event_count = 0;
-    int j = 0;
-    int cur_wfd = -1;
 
-    if (fdcount == -1) {
+    if (signalfd(es->sigfd, &fws->sigmask, SFD_NONBLOCK | SFD_CLOEXEC) == -1) {
         return FW_EVT_ERR;
     }
+    return FW_EVT_OK;
+}
 
-    if (fdcount > 0) {
-        for (int i = 0; i < fdcount; ++i) {
-            change = &es->events[i];
+static void fwLoopStateWake(fwState *fws) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    uint64_t one = 1;
+    (void)write(es->wakefd, &one, sizeof(one));
+}
 
-            if ((event_count = read(es->ifd, event_buffer, EVENT_BUF_LEN)) <= 0) {
-                return FW_EVT_ERR;
-            }
+static void fwEvtStateRelease(fwState *fws) {
+    if (fws) {
+        fwEvtState *es = fwLoopGetEvtState(fws);
+        if (es) {
+            fwEvtStateFree(es);
+        }
+    }
+}
+
+/* Map an inotify mask on to the closest FW_EVT_* mask */
+static int fwInotifyToEvtMask(uint32_t mask) {
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        return FW_EVT_CREATE;
+    } else if (mask & IN_DELETE) {
+        return FW_EVT_DELETE;
+    } else if (mask & IN_MODIFY) {
+        return FW_EVT_WATCH;
+    } else if (mask & IN_IGNORED) {
+        return FW_EVT_WATCH | FW_EVT_DELETE;
+    } else if (mask & IN_OPEN) {
+        return FW_EVT_OPEN;
+    } else if (mask & IN_DELETE_SELF) {
+        return FW_EVT_DELETE;
+    } else if (mask & (IN_MOVE_SELF | IN_MOVED_FROM)) {
+        return FW_EVT_MOVE;
+    } else if (mask & IN_ATTRIB) {
+        return FW_EVT_WATCH;
+    } else if (mask & IN_CLOSE) {
+        return FW_EVT_CLOSE;
+    }
+    return 0;
+}
 
-            while (i < event_count) {
-                event = (struct inotify_event *)&event_buffer[i];
-                cur_wfd = event->wd;
-                evt = &fws->active[j];
-                evt->fd = event->wd;
+static int fwQueueEmpty(fwQueue *q) {
+    return q->head == q->tail && q->spill_head == q->spill_tail;
+}
 
-                if (cur_wfd == -1) {
-                    cur_wfd = event->wd;
-                    j = 0;
-                } else {
-                    if (cur_wfd != event->wd) {
-                        j++;
-                    }
-                }
+/* Anything still to dispatch, the next poll should not block if so */
+static int fwQueuePending(fwQueue *q) {
+    return !fwQueueEmpty(q) || q->dirty_count;
+}
 
-                if (event != NULL) {
-                    if (event->mask & IN_CREATE) {
-                        evt->mask = FW_EVT_CREATE;
+/* Coalesced events are kept per watch id rather than wd, wds only grow */
+static void fwQueueMark(fwQueue *q, int id, int mask) {
+    if (!(q->dirty[id / 64] & (1ull << (id % 64)))) {
+        q->dirty[id / 64] |= 1ull << (id % 64);
+        q->dirty_count++;
+        q->dirty_mask[id] = 0;
+    }
+    /* Every kind of change folded in, not only the last */
+    q->dirty_mask[id] |= mask;
+}
 
-                    } else if (event->mask & IN_DELETE) {
-                        evt->mask = FW_EVT_DELETE;
+/* The kernel dropped events, so anything may have changed */
+static void fwQueueOverflow(fwState *fws, fwQueue *q) {
+    fwWarn("inotify queue overflowed, marking every watch\n");
+    for (int id = 0; id < fws->idle_cap; ++id) {
+        if (fws->idle[id].mask != FW_EVT_ADD) {
+            fwQueueMark(q, id, FW_EVT_WATCH);
+        }
+    }
+    q->coalescing = 1;
+}
 
-                    } else if (event->mask & IN_MODIFY) {
-                        evt->mask = FW_EVT_WATCH;
+/* Room for coalescing events of watch ids up to 'cap' */
+static int fwLoopStateGrow(fwState *fws, int cap) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    fwQueue *q = &es->queue;
+    int words = (fws->idle_cap + 63) / 64, new_words = (cap + 63) / 64;
+    uint64_t *dirty;
+    int *dirty_mask;
 
-                    } else if (event->mask & IN_IGNORED) {
-                        evt->mask = FW_EVT_WATCH | FW_EVT_DELETE;
+    if ((dirty = realloc(q->dirty, sizeof(uint64_t) * new_words)) == NULL) {
+        return -1;
+    }
+    memset(dirty + words, 0, sizeof(uint64_t) * (new_words - words));
+    q->dirty = dirty;
 
-                    } else if (event->mask & IN_OPEN) {
-                        evt->mask = FW_EVT_OPEN;
+    if ((dirty_mask = realloc(q->dirty_mask, sizeof(int) * cap)) == NULL) {
+        return -1;
+    }
+    q->dirty_mask = dirty_mask;
+    return 0;
+}
 
-                    } else if (event->mask & IN_DELETE_SELF) {
-                        evt->mask = FW_EVT_DELETE;
+/* The watch is gone, a coalesced event for it must not reach its successor */
+static void fwLoopStateForget(fwState *fws, int id) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    fwQueue *q = &es->queue;
 
-                    } else if (event->mask & IN_MOVE_SELF) {
-                        evt->mask = FW_EVT_MOVE;
+    if (q->dirty[id / 64] & (1ull << (id % 64))) {
+        q->dirty[id / 64] &= ~(1ull << (id % 64));
+        q->dirty_count--;
+    }
+}
 
-                    } else if (event->mask & IN_ATTRIB) {
-                        evt->mask = FW_EVT_WATCH;
+/* Append to the overflow file, growing it as needed */
+static int fwQueueSpill(fwQueue *q, struct inotify_event *event,
+                        size_t size) {
+    size_t cap;
+    char *map;
+
+    if (q->spill_fd == -1) {
+        const char *dir = getenv("TMPDIR");
+        if ((q->spill_fd = open(dir ? dir : "/tmp", O_TMPFILE | O_RDWR |
+                                O_CLOEXEC, 0600)) == -1) {
+            return -1;
+        }
+    }
 
-                    } else if (event->mask & IN_CLOSE) {
-                        evt->mask = FW_EVT_CLOSE;
-                    }
-                }
-                i += EVENT_SIZE + event->len;
-            }
+    if (q->spill_tail + size > q->spill_cap) {
+        cap = q->spill_cap ? q->spill_cap * 2 : q->max;
+        while (cap < q->spill_tail + size) {
+            cap *= 2;
         }
-    } else if (fdcount == -1) {
-        return FW_EVT_ERR;
+        if (ftruncate(q->spill_fd, cap) == -1) {
+            return -1;
+        }
+        map = q->spill ? mremap(q->spill, q->spill_cap, cap, MREMAP_MAYMOVE)
+                       : mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              q->spill_fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        fwDebug("Spilling events, %zu bytes\n", cap);
+        q->spill = map;
+        q->spill_cap = cap;
     }
 
-    return fdcount;
+    memcpy(q->spill + q->spill_tail, event, size);
+    q->spill_tail += size;
+    return 0;
 }
 
-#endif
-
-/*============================================================================
- * GENERIC API
- *============================================================================*/
+/* Everything in memory is older than anything spilled, so once spilling
+ * starts it carries on until the file has been drained */
+static void fwQueueAppend(fwQueue *q, struct inotify_event *event,
+                          size_t size, int id) {
+    size_t cap;
+    char *mem;
+    int mask;
 
-int fwLoopAddEvent(fwState *fws, int fd, int mask, fwEvtCallback *cb,
-                   void *data) {
-    fwEvt *ev;
+    /* What is left moves down over what was popped only once it is needed,
+     * at most once per read as the head stays put until the next pop */
+    if (q->head && q->tail + size > q->mem_cap) {
+        memmove(q->mem, q->mem + q->head, q->tail - q->head);
+        q->tail -= q->head;
+        q->head = 0;
+    }
 
-    if (fd >= fws->max_events) {
-        return FW_EVT_ERR;
+    if (q->spill_head == q->spill_tail && q->tail + size <= q->max) {
+        if (q->tail + size > q->mem_cap) {
+            cap = q->mem_cap ? q->mem_cap * 2 : EVENT_BUF_LEN;
+            while (cap < q->tail + size) {
+                cap *= 2;
+            }
+            if (cap > q->max) {
+                cap = q->max;
+            }
+            if ((mem = realloc(q->mem, cap)) == NULL) {
+                goto mark;
+            }
+            q->mem = mem;
+            q->mem_cap = cap;
+        }
+        memcpy(q->mem + q->tail, event, size);
+        q->tail += size;
+        return;
     }
 
+    if (fwQueueSpill(q, event, size) == 0) {
+        return;
+    }
+    fwWarn("Cannot spill events: %s\n", strerror(errno));
+
+mark:
+    /* Better to lose the name than the change */
+    if ((mask = fwInotifyToEvtMask(event->mask))) {
+        fwQueueMark(q, id, mask);
+    }
+}
+
+/* Called before reading, names handed out by the last fwQueuePop are no
+ * longer in use. Only a drained queue starts over, anything else is moved
+ * by fwQueueAppend when it runs out of room */
+static void fwQueueCompact(fwQueue *q) {
+    if (q->head == q->tail) {
+        q->head = q->tail = 0;
+    }
+    if (q->spill && q->spill_head == q->spill_tail) {
+        fwQueueSpillRelease(q);
+    }
+}
+
+/* Queue 'len' bytes of raw inotify events from es->buf */
+static void fwQueuePush(fwState *fws, ssize_t len) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    fwQueue *q = &es->queue;
+    struct inotify_event *event;
+    size_t size;
+    int mask, id;
+
+    for (ssize_t i = 0; i < len; i += size) {
+        event = (struct inotify_event *)&es->buf[i];
+        size = EVENT_SIZE + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            fwQueueOverflow(fws, q);
+            continue;
+        }
+
+        /* Such as the IN_IGNORED for a watch that was removed */
+        if ((id = fwIdMapGet(&fws->watch_ids, event->wd, 0)) == -1) {
+            continue;
+        }
+
+        if (!q->coalescing &&
+            (q->tail - q->head) + (q->spill_tail - q->spill_head) >=
+                    q->max / 2) {
+            fwDebug("Coalescing events\n");
+            q->coalescing = 1;
+        }
+
+        /* Events on a file only matter for their watch, a name does not */
+        if (q->coalescing && event->len == 0) {
+            if ((mask = fwInotifyToEvtMask(event->mask))) {
+                fwQueueMark(q, id, mask);
+            }
+            continue;
+        }
+
+        fwQueueAppend(q, event, size, id);
+    }
+}
+
+/* Fill fws->active with as much as fits, queued records in order and then
+ * the coalesced watches once nothing older is left. Records keep the wd and
+ * are mapped to a watch id here, so those for a watch removed since they
+ * were queued are dropped. Names stay valid until the next fwQueueCompact.
+ * Returns the number of active events */
+static int fwQueuePop(fwState *fws) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    fwQueue *q = &es->queue;
+    uint64_t start = fwTraceStart();
+    struct inotify_event *event;
+    fwBatchEvt *evt;
+    int j = 0, id;
+
+    while (j < fws->active_cap) {
+        if (q->head < q->tail) {
+            event = (struct inotify_event *)(q->mem + q->head);
+            q->head += EVENT_SIZE + event->len;
+        } else if (q->spill_head < q->spill_tail) {
+            event = (struct inotify_event *)(q->spill + q->spill_head);
+            q->spill_head += EVENT_SIZE + event->len;
+        } else {
+            break;
+        }
+
+        if ((id = fwIdMapGet(&fws->watch_ids, event->wd, 0)) == -1) {
+            continue;
+        }
+        evt = &fws->active[j++];
+        evt->wd = id;
+        evt->mask = fwInotifyToEvtMask(event->mask);
+        evt->cookie = event->cookie;
+        evt->name = event->len ? event->name : "";
+    }
+
+    for (int w = 0; q->dirty_count && fwQueueEmpty(q) &&
+                    j < fws->active_cap && w < (fws->idle_cap + 63) / 64;
+         ++w) {
+        while (q->dirty[w] && j < fws->active_cap) {
+            id = w * 64 + __builtin_ctzll(q->dirty[w]);
+
+            q->dirty[w] &= q->dirty[w] - 1;
+            q->dirty_count--;
+            evt = &fws->active[j++];
+            evt->wd = id;
+            evt->mask = q->dirty_mask[id];
+            evt->cookie = 0;
+            evt->name = "";
+        }
+    }
+
+    if (q->coalescing && !fwQueuePending(q)) {
+        fwDebug("Caught up, queueing events again\n");
+        q->coalescing = 0;
+    }
+
+    fws->flow = fwTraceFlowNew();
+    fwTraceSpanFlow(decode, start, j, fws->flow, FW_FLOW_START);
+    return j;
+}
+
+static int fwLoopStateQueueLimit(fwState *fws, size_t bytes) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+
+    /* Every record has to fit, even with the longest name */
+    if (bytes < EVENT_BUF_LEN) {
+        return -1;
+    }
+    es->queue.max = bytes;
+    return 0;
+}
+
+/* A trace is this header followed by a fwTraceBatch and its raw inotify
+ * bytes for every read, all in host byte order */
+#define FW_TRACE_MAGIC   "FWTR"
+#define FW_TRACE_VERSION 1
+
+typedef struct fwTraceHeader {
+    char magic[4];
+    uint32_t version;
+} fwTraceHeader;
+
+typedef struct fwTraceBatch {
+    /* Since recording started */
+    uint64_t ns;
+    uint32_t len;
+    uint32_t pad;
+} fwTraceBatch;
+
+static int fwLoopStateRecord(fwState *fws, char *trace_path) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    fwTraceHeader hdr = {FW_TRACE_MAGIC, FW_TRACE_VERSION};
+
+    if (es->trace) {
+        fclose(es->trace);
+        es->trace = NULL;
+    }
+
+    if (trace_path == NULL) {
+        return 0;
+    }
+
+    if ((es->trace = fopen(trace_path, "wbe")) == NULL) {
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, es->trace) != 1) {
+        fclose(es->trace);
+        es->trace = NULL;
+        return -1;
+    }
+    es->trace_start = fwMonotonicNs();
+    return 0;
+}
+
+/* Buffered by stdio so recording costs no extra syscall per read */
+static void fwLoopStateTrace(fwEvtState *es, ssize_t len) {
+    fwTraceBatch batch = {0};
+
+    batch.ns = fwMonotonicNs() - es->trace_start;
+    batch.len = len;
+    if (fwrite(&batch, sizeof(batch), 1, es->trace) != 1 ||
+        fwrite(es->buf, len, 1, es->trace) != 1) {
+        fwWarn("Failed to write trace, stopping\n");
+        fclose(es->trace);
+        es->trace = NULL;
+    }
+}
+
+/* Feed a recorded trace through decoding and dispatch in place of the
+ * inotify fd. Watch descriptors are taken as they were recorded, so the
+ * same files must have been added in the same order */
+static long fwLoopStateReplay(fwState *fws, char *trace_path, int realtime) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct signalfd_siginfo si;
+    fwTraceHeader hdr;
+    fwTraceBatch batch;
+    uint64_t start, now;
+    struct timespec ts;
+    long events = 0;
+    FILE *fp;
+    int count;
+
+    if ((fp = fopen(trace_path, "rbe")) == NULL) {
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, FW_TRACE_MAGIC, 4) ||
+        hdr.version != FW_TRACE_VERSION) {
+        fclose(fp);
+        return -1;
+    }
+
+    start = fwMonotonicNs();
+    while (fws->run_loop && fread(&batch, sizeof(batch), 1, fp) == 1) {
+        if (batch.len > EVENT_BUF_LEN ||
+            fread(es->buf, batch.len, 1, fp) != 1) {
+            events = -1;
+            break;
+        }
+
+        if (realtime && (now = fwMonotonicNs() - start) < batch.ns) {
+            ts.tv_sec = (batch.ns - now) / 1000000000ull;
+            ts.tv_nsec = (batch.ns - now) % 1000000000ull;
+            nanosleep(&ts, NULL);
+        }
+
+        fwQueueCompact(&es->queue);
+        fwQueuePush(fws, batch.len);
+        while ((count = fwQueuePop(fws))) {
+            events += count;
+            fwLoopDispatch(fws, count);
+        }
+
+        /* Nothing is polling, so look for a stop request here */
+        while (read(es->sigfd, &si, sizeof(si)) == sizeof(si)) {
+            fwLoopFanSignal(si.ssi_signo);
+        }
+        fwLoopRunSignals(fws);
+    }
+
+    fclose(fp);
+    return events;
+}
+
+/* Drain the inotify fd into the queue, up to FW_QUEUE_READS buffers. The
+ * descriptor is level triggered so anything left is read on the next poll */
+static void fwLoopReadInotify(fwState *fws) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    uint64_t start;
+    ssize_t len;
+
+    for (int i = 0; i < FW_QUEUE_READS; ++i) {
+        start = fwTraceStart();
+        if ((len = read(es->ifd, es->buf, EVENT_BUF_LEN)) <= 0) {
+            return;
+        }
+        fwTraceSpan(inotify_read, start, len);
+
+        if (es->trace) {
+            fwLoopStateTrace(es, len);
+        }
+        fwQueuePush(fws, len);
+    }
+}
+
+static int fwLoopPoll(fwState *fws) {
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct signalfd_siginfo si;
+    uint64_t wakeups;
+    /* Left over from a storm, or block maps still being hashed, check for
+     * more without waiting */
+    int timeout = fwQueuePending(&es->queue) || fws->blocks_pending_count
+                          ? 0
+                          : fwJobsTimeout(fws, fws->poll_timeout);
+    int fdcount = epoll_wait(es->epollfd, es->events, fws->max_events,
+                             timeout);
+
+    if (fdcount == -1) {
+        return errno == EINTR ? 0 : FW_EVT_ERR;
+    }
+
+    fwQueueCompact(&es->queue);
+    for (int i = 0; i < fdcount; ++i) {
+        int fd = es->events[i].data.fd;
+
+        if (fd == es->ifd) {
+            fwLoopReadInotify(fws);
+        } else if (fd == es->sigfd) {
+            while (read(es->sigfd, &si, sizeof(si)) == sizeof(si)) {
+                fwLoopFanSignal(si.ssi_signo);
+            }
+        } else if (fd == es->wakefd) {
+            (void)read(es->wakefd, &wakeups, sizeof(wakeups));
+        } else {
+            int mask = 0;
+            if (es->events[i].events & EPOLLIN) {
+                mask |= FW_IO_READ;
+            }
+            if (es->events[i].events & EPOLLOUT) {
+                mask |= FW_IO_WRITE;
+            }
+            /* Whatever the callback tries next will see the error */
+            if (es->events[i].events & (EPOLLHUP | EPOLLERR)) {
+                mask |= FW_IO_READ | FW_IO_WRITE;
+            }
+            fwLoopDispatchIo(fws, fd, mask);
+        }
+    }
+
+    return fwQueuePop(fws);
+}
+
+#endif
+
+/*============================================================================
+ * GENERIC API
+ *============================================================================*/
+
+/* Every loop in the process, signals are fanned out to all of them */
+static fwState *fw_loops = NULL;
+static pthread_mutex_t fw_loops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A free slot in 'idle', growing everything kept per watch id if there is
+ * none */
+static int fwLoopWatchSlot(fwState *fws) {
+    int cap = fws->idle_cap * 2, *ids;
+    fwEvt *idle;
+
+    if (fws->event == NULL) {
+        while (fws->idle_dead_count) {
+            fws->idle_free[fws->idle_free_count++] =
+                    fws->idle_dead[--fws->idle_dead_count];
+        }
+    }
+
+    if (fws->idle_free_count) {
+        return fws->idle_free[--fws->idle_free_count];
+    }
+
+    if ((idle = realloc(fws->idle, sizeof(fwEvt) * cap)) == NULL) {
+        return -1;
+    }
+    fws->idle = idle;
+    if ((ids = realloc(fws->wd_last, sizeof(int) * cap)) == NULL) {
+        return -1;
+    }
+    fws->wd_last = ids;
+    if ((ids = realloc(fws->idle_free, sizeof(int) * cap)) == NULL) {
+        return -1;
+    }
+    fws->idle_free = ids;
+    if ((ids = realloc(fws->idle_dead, sizeof(int) * cap)) == NULL) {
+        return -1;
+    }
+    fws->idle_dead = ids;
+    if (fwLoopStateGrow(fws, cap) == -1) {
+        return -1;
+    }
+
+    for (int i = cap - 1; i >= fws->idle_cap; --i) {
+        fws->idle[i].mask = FW_EVT_ADD;
+        fws->wd_last[i] = -1;
+        fws->idle_free[fws->idle_free_count++] = i;
+    }
+    fws->idle_cap = cap;
+    return fws->idle_free[--fws->idle_free_count];
+}
+
+/* Watch 'fd', returning the watch id the callback is handed or FW_EVT_ERR.
+ * inotify watches by path, so on linux the fd is closed once it is watched
+ * and left open if it could not be */
+static int fwLoopAddWatch(fwState *fws, int fd, int mask, fwEvtCallback *cb,
+                          void *data) {
+    fwEvt *ev;
+    int wd, id;
+
 #if defined(IS_BSD)
-    fwDebug(">>%d\n", fd);
     if (fwLoopStateAdd(fws, fd, mask) == FW_EVT_ERR) {
         return FW_EVT_ERR;
     }
-    ev = &fws->idle[fd];
+    wd = fd;
+#elif defined(IS_LINUX)
+    if ((wd = fwLoopStateAdd(fws, fd, mask)) == FW_EVT_ERR) {
+        return FW_EVT_ERR;
+    }
 #endif
 
-/* We do not need the filedescriptor as inotify uses it's own filedescriptors */
+    /* Another name for an inode that is already watched */
+    if (fwIdMapGet(&fws->watch_ids, wd, 0) != -1) {
+        return FW_EVT_ERR;
+    }
+
+    if ((id = fwLoopWatchSlot(fws)) == -1) {
+        fwLoopStateDelete(fws, wd, mask);
+        return FW_EVT_ERR;
+    }
+
+    if (fwIdMapPut(&fws->watch_ids, wd, 0, id) == -1) {
+        fws->idle_free[fws->idle_free_count++] = id;
+        fwLoopStateDelete(fws, wd, mask);
+        return FW_EVT_ERR;
+    }
+
+    ev = &fws->idle[id];
+    ev->fd = fd;
+    ev->wd = wd;
+    ev->mask = FW_EVT_ADD | mask;
+    ev->data = data;
+    ev->watch = cb;
 #if defined(IS_LINUX)
-    int wfd = 0;
-    if ((wfd = fwLoopStateAdd(fws, fd, mask)) == FW_EVT_ERR) {
+    close(fd);
+#endif
+    return id;
+}
+
+int fwLoopAddEvent(fwState *fws, int fd, int mask, fwEvtCallback *cb,
+                   void *data) {
+    if (fwLoopAddWatch(fws, fd, mask, cb, data) == FW_EVT_ERR) {
+        return FW_EVT_ERR;
+    }
+    return FW_EVT_OK;
+}
+
+/* 'fd' is the watch id callbacks are handed */
+void fwLoopDeleteEvent(fwState *fws, int fd, int mask) {
+    fwEvt *ev;
+
+    if (fd < 0 || fd >= fws->idle_cap) {
+        return;
+    }
+
+    ev = &fws->idle[fd];
+
+    if (ev->mask == FW_EVT_ADD) {
+        return;
+    }
+
+    fwLoopStateDelete(fws, ev->wd, mask);
+    ev->mask = ev->mask & (~mask);
+    if (ev->mask == FW_EVT_ADD) {
+        fwIdMapDel(&fws->watch_ids, ev->wd, 0);
+        fwLoopStateForget(fws, fd);
+        if (fws->event) {
+            fws->idle_dead[fws->idle_dead_count++] = fd;
+        } else {
+            fws->idle_free[fws->idle_free_count++] = fd;
+        }
+    }
+}
+
+/* Serve 'fd' from the loop, 'cb' is invoked with the FW_IO_* that are
+ * ready. Calling again replaces the interest, a mask of 0 removes it */
+static int fwLoopSetIo(fwState *fws, int fd, int mask, fwIoCallback *cb,
+                       void *data) {
+    fwIo *io;
+
+    if (fd < 0) {
         return FW_EVT_ERR;
     }
-    ev = &fws->idle[wfd];
-    ev->fd = fd;
-#endif
 
-    ev->mask |= mask;
-    ev->data = data;
-    ev->watch = cb;
+    if (fd >= fws->io_cap) {
+        int cap = fws->io_cap ? fws->io_cap : 16;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        if ((io = realloc(fws->io, sizeof(fwIo) * cap)) == NULL) {
+            return FW_EVT_ERR;
+        }
+        memset(io + fws->io_cap, 0, sizeof(fwIo) * (cap - fws->io_cap));
+        fws->io = io;
+        fws->io_cap = cap;
+    }
+
+    io = &fws->io[fd];
+    if (io->mask != mask &&
+        fwLoopStateIo(fws, fd, io->mask, mask) == FW_EVT_ERR) {
+        return FW_EVT_ERR;
+    }
+
+    io->mask = mask;
+    io->cb = mask ? cb : NULL;
+    io->data = mask ? data : NULL;
+    return FW_EVT_OK;
+}
+
+int fwLoopAddFd(fwState *fws, int fd, int mask, fwIoCallback *cb,
+                void *data) {
+    mask &= FW_IO_READ | FW_IO_WRITE;
+    if (mask == 0 || cb == NULL) {
+        return FW_EVT_ERR;
+    }
+    return fwLoopSetIo(fws, fd, mask, cb, data);
+}
+
+void fwLoopDelFd(fwState *fws, int fd) {
+    if (fd >= 0 && fd < fws->io_cap && fws->io[fd].mask) {
+        fwLoopSetIo(fws, fd, 0, NULL, NULL);
+    }
+}
+
+static void fwLoopDispatchIo(fwState *fws, int fd, int mask) {
+    fwIo *io;
+
+    if (fd >= fws->io_cap) {
+        return;
+    }
+
+    io = &fws->io[fd];
+    mask &= io->mask;
+    /* A callback earlier in the same poll may have removed it */
+    if (io->cb && mask) {
+        io->cb(fws, fd, io->data, mask);
+    }
+}
+
+int fwLoopAddSignal(fwState *fws, int signo, fwSignalCallback *cb,
+                    void *data) {
+    sigset_t sigs;
+
+    if (signo <= 0 || signo >= NSIG || signo > 64) {
+        return FW_EVT_ERR;
+    }
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, signo);
+    if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0) {
+        return FW_EVT_ERR;
+    }
+
+    /* fwLoopFanSignal reads the mask of every loop */
+    pthread_mutex_lock(&fw_loops_lock);
+    if (!sigismember(&fws->sigmask, signo)) {
+        sigaddset(&fws->sigmask, signo);
+        if (fwLoopStateSignal(fws, signo) == FW_EVT_ERR) {
+            sigdelset(&fws->sigmask, signo);
+            pthread_mutex_unlock(&fw_loops_lock);
+            return FW_EVT_ERR;
+        }
+    }
+    pthread_mutex_unlock(&fw_loops_lock);
+
+    fws->signals[signo].cb = cb;
+    fws->signals[signo].data = data;
+    return FW_EVT_OK;
+}
+
+/* A process directed signal is read by whichever loop the OS picks, so it
+ * is raised in every loop reading that signal, the one that read it
+ * included. Each then handles it on its own thread */
+static void fwLoopFanSignal(int signo) {
+    fwDebug("Received signal: %d\n", signo);
+    if (signo <= 0 || signo > 64) {
+        return;
+    }
+
+    pthread_mutex_lock(&fw_loops_lock);
+    for (fwState *fws = fw_loops; fws; fws = fws->loop_next) {
+        if (sigismember(&fws->sigmask, signo)) {
+            __atomic_fetch_or(&fws->signals_raised, 1ull << (signo - 1),
+                              __ATOMIC_SEQ_CST);
+            fwLoopStateWake(fws);
+        }
+    }
+    pthread_mutex_unlock(&fw_loops_lock);
+}
+
+/* Signals without a callback stop the loop */
+static void fwLoopRunSignals(fwState *fws) {
+    unsigned long long raised;
+    fwSignal *sig;
+
+    raised = __atomic_exchange_n(&fws->signals_raised, 0, __ATOMIC_SEQ_CST);
+    while (raised) {
+        int signo = __builtin_ctzll(raised) + 1;
+
+        raised &= raised - 1;
+        sig = &fws->signals[signo];
+        if (sig->cb) {
+            sig->cb(fws, signo, sig->data);
+        } else {
+            fwLoopStop(fws);
+        }
+    }
+}
+
+/* Wall clock time, pid and address together, nothing else has all three */
+static unsigned long long fwLoopNewInstance(fwState *fws) {
+    struct timespec ts;
+    uint64_t h;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h = ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec) ^
+        ((uint64_t)getpid() << 40) ^ (uintptr_t)fws;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+/* The dynamic array for storing file state */
+fwState *fwStateNew(char *command, int max_events, int timeout) {
+    fwState *fws;
+    int batch_size = fwLoopBatchSize(max_events);
+
+    if ((fws = malloc(sizeof(fwState))) == NULL) {
+        return NULL;
+    }
+
+    fws->files_array = NULL;
+    fws->idle = NULL;
+    fws->idle_free = NULL;
+    fws->idle_dead = NULL;
+    fws->active = NULL;
+    fws->wd_last = NULL;
+    fws->wd_prev = NULL;
+    fws->io = NULL;
+    fws->io_cap = 0;
+    fws->daemon = NULL;
+    fws->output = NULL;
+    fws->evt_state = NULL;
+
+    if ((fws->files_array = malloc(sizeof(fwFile *) * 10)) == NULL) {
+        goto error;
+    }
+
+    if ((fws->idle = malloc(sizeof(fwEvt) * max_events)) == NULL ||
+        (fws->idle_free = malloc(sizeof(int) * max_events)) == NULL ||
+        (fws->idle_dead = malloc(sizeof(int) * max_events)) == NULL) {
+        goto error;
+    }
+
+    if (batch_size < max_events) {
+        batch_size = max_events;
+    }
+    if ((fws->active = malloc(sizeof(fwBatchEvt) * batch_size)) == NULL) {
+        goto error;
+    }
+
+    if ((fws->wd_last = malloc(sizeof(int) * max_events)) == NULL) {
+        goto error;
+    }
+
+    if ((fws->wd_prev = malloc(sizeof(int) * batch_size)) == NULL) {
+        goto error;
+    }
+    fws->active_cap = batch_size;
+
+    /* Block the signals the loop reads itself, threads created after this
+     * inherit the mask so only the loops see them. Whichever loop reads one
+     * hands it to the others, see fwLoopFanSignal */
+    fwSignalSet(&fws->sigmask);
+    pthread_sigmask(SIG_BLOCK, &fws->sigmask, NULL);
+    memset(fws->signals, 0, sizeof(fws->signals));
+
+    if ((fws->evt_state = fwLoopStateNew(max_events)) == NULL) {
+        goto error;
+    }
+
+    fws->files_count = 0;
+    fws->files_mem_capacity = 10;
+    fws->rules = NULL;
+    fws->rules_count = 0;
+    fws->rule_next = 0;
+    fws->jobs = NULL;
+    fws->jobs_cap = 0;
+    fws->jobs_running = 0;
+    fws->jobs_pending = 0;
+    fws->capture_size = 0;
+    fws->capture_log = -1;
+    fws->capture_pipe[0] = fws->capture_pipe[1] = -1;
+    fws->line_cb = NULL;
+    fws->line_data = NULL;
+    fws->block_rules = NULL;
+    fws->block_rules_count = 0;
+    fws->blocks_pending = NULL;
+    fws->blocks_pending_count = 0;
+    fws->blocks_pending_cap = 0;
+    fws->deps = NULL;
+    fws->max_events = max_events;
+    fws->idle_cap = max_events;
+    fws->idle_free_count = 0;
+    fws->idle_dead_count = 0;
+    memset(&fws->watch_ids, 0, sizeof(fwIdMap));
+    memset(&fws->file_names, 0, sizeof(fwNames));
+    memset(&fws->file_inodes, 0, sizeof(fwIdMap));
+    memset(&fws->dir_names, 0, sizeof(fwNames));
+    fws->dirs = NULL;
+    fws->dirs_count = 0;
+    fws->event = NULL;
+    fws->active_count = 0;
+    fws->signals_raised = 0;
+    fws->poll_timeout = timeout;
+    fws->processed_events = 0;
+    fws->clock = 0;
+    fws->instance = fwLoopNewInstance(fws);
+    fws->changes_oldest = NULL;
+    fws->changes_newest = NULL;
+    fws->run_loop = 1;
+    fws->replaying = 0;
+    fws->flow = 0;
+
+    /* Handed out lowest id first */
+    for (int i = fws->max_events - 1; i >= 0; --i) {
+        fws->idle[i].mask = FW_EVT_ADD;
+        fws->wd_last[i] = -1;
+        fws->idle_free[fws->idle_free_count++] = i;
+    }
+    memset(fws->subs, 0, sizeof(fws->subs));
+
+    pthread_mutex_lock(&fw_loops_lock);
+    fws->loop_next = fw_loops;
+    fw_loops = fws;
+    pthread_mutex_unlock(&fw_loops_lock);
+
+    /* The command given here keeps the old behaviour of killing the last run
+     * whenever anything changes */
+    if (fwSetMaxJobs(fws, 1) == -1 ||
+        (command && fwAddRule(fws, NULL, command, FW_JOB_RESTART) == -1)) {
+        fwStateRelease(fws);
+        return NULL;
+    }
+    fwDebug("Pre CREATE LOOP STATE\n");
+
+
+    return fws;
+
+error:
+    fwDebug("Failed to create eventloop\n");
+    free(fws->files_array);
+    free(fws->idle);
+    free(fws->idle_free);
+    free(fws->idle_dead);
+    free(fws->active);
+    free(fws->wd_last);
+    free(fws->wd_prev);
+    free(fws);
+    return NULL;
+}
+
+/* Destroy the event loop and OS specific event state. Closes all open file
+ * descriptors, names of files and command */
+void fwStateRelease(fwState *fws) {
+    if (fws) {
+        pthread_mutex_lock(&fw_loops_lock);
+        for (fwState **cur = &fw_loops; *cur; cur = &(*cur)->loop_next) {
+            if (*cur == fws) {
+                *cur = fws->loop_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&fw_loops_lock);
+
+        fwJobsStop(fws);
+        for (int i = 0; i < fws->files_count; ++i) {
+            fwFile *fw = fws->files_array[i];
+            if (fw->fd != -1) {
+                close(fw->fd);
+            }
+            free(fw->name);
+            fwBlocksRelease(fw->blocks);
+            free(fw);
+        }
+        free(fws->files_array);
+        free(fws->file_names.slots);
+        free(fws->file_inodes.slots);
+        for (int i = 0; i < fws->dirs_count; ++i) {
+            if (fws->dirs[i]->fd != -1) {
+                close(fws->dirs[i]->fd);
+            }
+            free(fws->dirs[i]->path);
+            free(fws->dirs[i]->ext);
+            free(fws->dirs[i]);
+        }
+        free(fws->dirs);
+        free(fws->dir_names.slots);
+        free(fws->watch_ids.slots);
+        for (int i = 0; i < fws->block_rules_count; ++i) {
+            free(fws->block_rules[i].pattern);
+        }
+        free(fws->block_rules);
+        free(fws->blocks_pending);
+        fwDepsRelease(fws->deps);
+        for (int i = 0; i < fws->rules_count; ++i) {
+            free(fws->rules[i].pattern);
+            free(fws->rules[i].command);
+            fwStreamRelease(fws->rules[i].output[FW_STDOUT]);
+            fwStreamRelease(fws->rules[i].output[FW_STDERR]);
+        }
+        fwCaptureClose(fws);
+        free(fws->rules);
+        free(fws->jobs);
+        free(fws->idle);
+        free(fws->idle_free);
+        free(fws->idle_dead);
+        free(fws->active);
+        free(fws->wd_last);
+        free(fws->wd_prev);
+        fwDaemonRelease(fws);
+        fwOutputRelease(fws);
+        free(fws->io);
+        fwEvtStateRelease(fws);
+        free(fws);
+    }
+}
+
+size_t fwLoopGetProcessedEventCount(fwState *fws) {
+    return fws->processed_events;
+}
+
+/* Absolute path for a path id from fwBatchEvt, NULL if it is unknown */
+const char *fwLoopGetPath(fwState *fws, int path_id) {
+    if (path_id < 0 || path_id >= fws->files_count) {
+        return NULL;
+    }
+    return fws->files_array[path_id]->name;
+}
+
+unsigned long long fwLoopGetClock(fwState *fws) {
+    return fws->clock;
+}
+
+unsigned long long fwLoopGetInstance(fwState *fws) {
+    return fws->instance;
+}
+
+/* Stamp 'fw' with the next clock value and move it to the newest end of the
+ * change list */
+static void fwFileChanged(fwState *fws, fwFile *fw, int mask) {
+    if (fw->changed_at) {
+        if (fw->older) {
+            fw->older->newer = fw->newer;
+        } else {
+            fws->changes_oldest = fw->newer;
+        }
+        if (fw->newer) {
+            fw->newer->older = fw->older;
+        } else {
+            fws->changes_newest = fw->older;
+        }
+    }
+
+    fw->changed_at = ++fws->clock;
+    fw->changed_mask = mask;
+    fw->newer = NULL;
+    fw->older = fws->changes_newest;
+    if (fws->changes_newest) {
+        fws->changes_newest->newer = fw;
+    } else {
+        fws->changes_oldest = fw;
+    }
+    fws->changes_newest = fw;
+}
+
+/* Call 'cb' for every file changed after 'since', oldest change first. Only
+ * the changed files are visited. Returns how many there were */
+size_t fwQuerySince(fwState *fws, unsigned long long since,
+                    fwQueryCallback *cb, void *data) {
+    fwFile *fw = fws->changes_newest;
+    size_t count = 0;
+
+    if (fw == NULL || fw->changed_at <= since) {
+        return 0;
+    }
+
+    while (fw->older && fw->older->changed_at > since) {
+        fw = fw->older;
+    }
+
+    for (; fw; fw = fw->newer, ++count) {
+        cb(fws, fw->name, fw->changed_at,
+           fw->deleted ? FW_EVT_DELETE : fw->changed_mask, data);
+    }
+    return count;
+}
+
+/* Safe to call from another thread, the loop is woken up to notice */
+void fwLoopStop(fwState *fws) {
+    fws->run_loop = 0;
+    fwLoopStateWake(fws);
+}
+
+/* Returns an id for fwLoopUnsubscribeBatch or FW_EVT_ERR if there are
+ * already FW_BATCH_SUBS_MAX subscribers */
+int fwLoopSubscribeBatch(fwState *fws, fwBatchCallback *cb, void *data) {
+    for (int i = 0; i < FW_BATCH_SUBS_MAX; ++i) {
+        if (fws->subs[i].cb == NULL) {
+            fws->subs[i].cb = cb;
+            fws->subs[i].data = data;
+            return i;
+        }
+    }
+    return FW_EVT_ERR;
+}
+
+void fwLoopUnsubscribeBatch(fwState *fws, int id) {
+    if (id >= 0 && id < FW_BATCH_SUBS_MAX) {
+        fws->subs[id].cb = NULL;
+        fws->subs[id].data = NULL;
+    }
+}
+
+/* Drop repeats of the same (wd, mask, cookie, name) from the active events
+ * and fill in the path ids, keeping the order of first occurrence. Returns
+ * the new number of active events */
+static int fwLoopMergeEvents(fwState *fws, int count) {
+    fwBatchEvt *evts = fws->active;
+    int merged = 0;
+
+    for (int i = 0; i < count; ++i) {
+        fwBatchEvt *evt = &evts[i];
+        fwEvt *ev = &fws->idle[evt->wd];
+        int k;
+
+        for (k = fws->wd_last[evt->wd]; k != -1; k = fws->wd_prev[k]) {
+            if (evts[k].mask == evt->mask && evts[k].cookie == evt->cookie &&
+                !strcmp(evts[k].name, evt->name)) {
+                break;
+            }
+        }
+
+        if (k != -1) {
+            continue;
+        }
+
+        evts[merged] = *evt;
+        evts[merged].path_id = -1;
+        evts[merged].seq = 0;
+        if (ev->mask != FW_EVT_ADD && ev->watch == fwListener) {
+            evts[merged].path_id = ((fwFile *)ev->data)->id;
+            fwFileChanged(fws, ev->data, evt->mask);
+            evts[merged].seq = fws->clock;
+        }
+        fws->wd_prev[merged] = fws->wd_last[evt->wd];
+        fws->wd_last[evt->wd] = merged;
+        merged++;
+    }
+
+    for (int i = 0; i < merged; ++i) {
+        fws->wd_last[evts[i].wd] = -1;
+    }
+    return merged;
+}
+
+/* Bound the memory used by events read ahead of dispatch, at least 32KiB.
+ * kqueue already folds events per file into one, so it has no queue */
+int fwSetQueueLimit(fwState *fws, size_t bytes) {
+#if defined(IS_LINUX)
+    return fwLoopStateQueueLimit(fws, bytes);
+#else
+    return 0;
+#endif
+}
+
+/* Start recording every batch read from the OS into 'trace_path', NULL
+ * stops recording. Only inotify can be recorded */
+int fwLoopRecord(fwState *fws, char *trace_path) {
+#if defined(IS_LINUX)
+    return fwLoopStateRecord(fws, trace_path);
+#else
+    return -1;
+#endif
+}
+
+/* Replay a trace from fwLoopRecord through the same decoding, merging and
+ * dispatch as live events, either at the recorded pace or as fast as
+ * possible. Nothing outside of the process is touched: the file listeners
+ * do not stat or re-watch, no jobs start and neither the daemon nor the
+ * output are written to. Batch subscribers and the logical clock still see
+ * every event. Returns the number of events replayed or -1 */
+long fwLoopReplay(fwState *fws, char *trace_path, int speed) {
+#if defined(IS_LINUX)
+    long events;
+
+    fws->replaying = 1;
+    events = fwLoopStateReplay(fws, trace_path, speed == FW_REPLAY_RECORDED);
+    fws->replaying = 0;
+    return events;
+#else
+    return -1;
+#endif
+}
+
+/* Add an event for 'fw' to the batch being dispatched, for changes a
+ * listener comes across itself such as files appearing in a directory.
+ * Listeners are not called for these, batch subscribers see them with the
+ * rest */
+static void fwLoopEmit(fwState *fws, fwFile *fw, int mask) {
+    int cap = fws->active_cap * 2, event, *prev;
+    fwBatchEvt *evt;
+
+    if (fws->event == NULL) {
+        return;
+    }
+
+    /* A burst of new files is when subscribers need them most, so the batch
+     * grows rather than dropping them. 'event' points into it */
+    if (fws->active_count == fws->active_cap) {
+        event = fws->event - fws->active;
+        if ((evt = realloc(fws->active, sizeof(fwBatchEvt) * cap)) == NULL) {
+            fwWarn("Dropped event for: %s\n", fw->name);
+            return;
+        }
+        fws->active = evt;
+        fws->event = &fws->active[event];
+        if ((prev = realloc(fws->wd_prev, sizeof(int) * cap)) == NULL) {
+            fwWarn("Dropped event for: %s\n", fw->name);
+            return;
+        }
+        fws->wd_prev = prev;
+        fws->active_cap = cap;
+    }
+
+    evt = &fws->active[fws->active_count++];
+    evt->wd = fw->wd;
+    evt->path_id = fw->id;
+    evt->mask = mask;
+    evt->cookie = 0;
+    evt->name = "";
+    evt->seq = fw->changed_at;
+}
+
+/* Merge and dispatch the first 'eventcount' active events */
+static void fwLoopDispatch(fwState *fws, int eventcount) {
+    uint64_t start = fwTraceStart(), listener;
+    /* kqueue has no decoding step to start the flow in */
+    int phase = fws->flow ? FW_FLOW_STEP : FW_FLOW_START;
+
+    if (eventcount == 0) {
+        fws->flow = 0;
+        return;
+    }
+    if (fws->flow == 0) {
+        fws->flow = fwTraceFlowNew();
+    }
+
+    eventcount = fwLoopMergeEvents(fws, eventcount);
+    fws->active_count = eventcount;
+
+    for (int i = 0; i < eventcount; ++i) {
+        int fd = fws->active[i].wd;
+        fwEvt *ev = &fws->idle[fd];
+        int mask = fws->active[i].mask;
+
+        /* If some kind of event that the user has subscribed to
+         * TODO: maintain user defined flags? Although we make a best effort
+         * to map our flags to the OS types. Events can still arrive for
+         * a watch that has just been removed */
+        if (mask && ev->mask != FW_EVT_ADD) {
+            listener = fwTraceStart();
+            fws->event = &fws->active[i];
+            ev->watch(fws, fd, ev->data, mask);
+            fwTraceSpanFlow(listener, listener, fd, fws->flow, FW_FLOW_STEP);
+        }
+        fws->processed_events++;
+    }
+    fws->event = NULL;
+
+    /* Once for the whole poll, rather than a restart per changed file */
+    fwJobsSchedule(fws);
+
+    for (int i = 0; i < FW_BATCH_SUBS_MAX; ++i) {
+        if (fws->subs[i].cb) {
+            fws->subs[i].cb(fws, fws->active, fws->active_count,
+                            fws->subs[i].data);
+        }
+    }
+    fwTraceSpanFlow(dispatch, start, eventcount, fws->flow, phase);
+    fws->flow = 0;
+}
+
+void fwLoopProcessEvents(fwState *fws) {
+    int eventcount;
+
+    if ((eventcount = fwLoopPoll(fws)) == FW_EVT_ERR) {
+        return;
+    }
+    fwLoopRunSignals(fws);
+    if (fws->jobs_running && fwJobsCheck(fws, 0)) {
+        fwJobsSchedule(fws);
+    }
+    fwLoopDispatch(fws, eventcount);
+    if (fws->blocks_pending_count) {
+        fwBlocksContinue(fws);
+    }
+}
+
+/*============================================================================
+ * JOBS
+ *============================================================================*/
+
+/* Largest FW_CHANGED we hand to a command, the kernel caps a single
+ * environment string at 128KiB */
+#define FW_CHANGED_MAX (64 * 1024)
+
+typedef struct fwChangedArgs {
+    fwRule *rule;
+    /* Every changed file, handed to the job as its stdin. For a rule using
+     * dependencies it is every affected target instead */
+    FILE *list;
+    /* The same list for FW_CHANGED, dropped if it gets too long */
+    char *buf;
+    size_t len;
+    int truncated;
+    /* Affected targets for FW_TARGETS separated by spaces, also dropped if
+     * it gets too long so make builds everything */
+    char *targets;
+    size_t targets_len;
+    int targets_count;
+} fwChangedArgs;
+
+static void fwDepsCollect(fwState *fws, const char *path,
+                          fwChangedArgs *args);
+
+static int fwRuleMatches(fwRule *rule, const char *path) {
+    return rule->pattern == NULL || fnmatch(rule->pattern, path, 0) == 0;
+}
+
+static void fwChangedAppend(fwState *fws, const char *path,
+                            unsigned long long clock, int mask, void *data) {
+    fwChangedArgs *args = data;
+    size_t len = strlen(path);
+
+    if (!fwRuleMatches(args->rule, path)) {
+        return;
+    }
+
+    if (args->rule->deps) {
+        fwDepsCollect(fws, path, args);
+    } else if (args->list) {
+        fprintf(args->list, "%s\n", path);
+    }
+
+    if (args->truncated || args->len + len + 2 > FW_CHANGED_MAX) {
+        args->truncated = 1;
+        return;
+    }
+    if (args->len) {
+        args->buf[args->len++] = '\n';
+    }
+    memcpy(args->buf + args->len, path, len + 1);
+    args->len += len;
+}
+
+/* Returns the id of the rule, the command is run through /bin/sh when files
+ * matching 'pattern' change, every file if 'pattern' is NULL */
+int fwAddRule(fwState *fws, char *pattern, char *command, int policy) {
+    fwRule *rules, *rule;
+
+    int deps = policy & FW_JOB_DEPS;
+
+    policy &= ~FW_JOB_DEPS;
+    if (policy != FW_JOB_RESTART && policy != FW_JOB_QUEUE &&
+        policy != FW_JOB_PARALLEL) {
+        return -1;
+    }
+
+    rules = realloc(fws->rules, sizeof(fwRule) * (fws->rules_count + 1));
+    if (rules == NULL) {
+        return -1;
+    }
+    fws->rules = rules;
+
+    rule = &fws->rules[fws->rules_count];
+    rule->pattern = pattern ? strdup(pattern) : NULL;
+    rule->command = strdup(command);
+    rule->policy = policy;
+    rule->deps = deps;
+    rule->pending = 0;
+    rule->running = 0;
+    rule->since = fws->clock;
+    rule->output[FW_STDOUT] = rule->output[FW_STDERR] = NULL;
+    return fws->rules_count++;
+}
+
+/* How many jobs may run at once, across every rule */
+int fwSetMaxJobs(fwState *fws, int max_jobs) {
+    fwJob *jobs;
+
+    if (max_jobs < 1) {
+        return -1;
+    }
+
+    if (max_jobs > fws->jobs_cap) {
+        if ((jobs = realloc(fws->jobs, sizeof(fwJob) * max_jobs)) == NULL) {
+            return -1;
+        }
+        for (int i = fws->jobs_cap; i < max_jobs; ++i) {
+            jobs[i].pid = -1;
+            jobs[i].pidfd = -1;
+            jobs[i].watched = 0;
+            jobs[i].stopping = 0;
+            jobs[i].kill_at = 0;
+            jobs[i].flow = 0;
+            jobs[i].out[FW_STDOUT] = jobs[i].out[FW_STDERR] = NULL;
+        }
+        fws->jobs = jobs;
+        fws->jobs_cap = max_jobs;
+    }
+    /* Jobs already running above a lower limit are left to finish */
+    fws->max_jobs = max_jobs;
+    return 0;
+}
+
+/* Mark every rule interested in 'fw' as having work to do */
+static void fwJobsMark(fwState *fws, fwFile *fw) {
+    for (int i = 0; i < fws->rules_count; ++i) {
+        if (fwRuleMatches(&fws->rules[i], fw->name) &&
+            (!fws->rules[i].deps || fwDepsAffects(fws, fw))) {
+            fws->rules[i].pending = 1;
+            fws->jobs_pending = 1;
+        }
+    }
+}
+
+#if defined(IS_LINUX)
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static void fwJobPidfdReady(fwState *fws, int fd, void *data, int mask) {
+    fwJobExited(fws, (pid_t)(intptr_t)data);
+}
+#endif
+
+/* Have the loop tell us when the job exits, a pidfd on linux and kqueue's
+ * EVFILT_PROC otherwise. Neither relies on SIGCHLD, which any loop in the
+ * process could read */
+static int fwJobWatch(fwState *fws, fwJob *job) {
+#if defined(IS_LINUX)
+    if ((job->pidfd = syscall(SYS_pidfd_open, job->pid, 0)) == -1) {
+        return -1;
+    }
+    fcntl(job->pidfd, F_SETFD, FD_CLOEXEC);
+    return fwLoopSetIo(fws, job->pidfd, FW_IO_READ, fwJobPidfdReady,
+                       (void *)(intptr_t)job->pid);
+#elif defined(IS_BSD)
+    fwEvtState *es = fwLoopGetEvtState(fws);
+    struct kevent change;
+
+    EV_SET(&change, job->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0,
+           NULL);
+    return __kevent(es->kfd, &change);
+#endif
+}
+
+/* Most bytes read from one stream per poll, so one chatty job cannot keep
+ * the loop from everything else. The pipe filling up slows the job down */
+#define FW_CAPTURE_BUDGET (64 * 1024)
+
+static void fwCaptureClose(fwState *fws) {
+    if (fws->capture_log != -1) {
+        close(fws->capture_log);
+        fws->capture_log = -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (fws->capture_pipe[i] != -1) {
+            close(fws->capture_pipe[i]);
+            fws->capture_pipe[i] = -1;
+        }
+    }
+}
+
+/* Capture the stdout and stderr of jobs through non-blocking pipes served by
+ * the loop, keeping the last 'ring_size' bytes of each and handing lines to
+ * the line callback. With 'log_path' the output is also copied into that
+ * file, by tee and splice where the OS has them. A 'ring_size' of 0 with no
+ * log turns capturing off */
+int fwSetCapture(fwState *fws, int ring_size, char *log_path) {
+    int fd = -1;
+
+    if (ring_size < 0) {
+        return -1;
+    }
+
+    if (log_path) {
+        /* splice(2) refuses files opened with O_APPEND */
+        if ((fd = open(log_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+            return -1;
+        }
+        lseek(fd, 0, SEEK_END);
+    }
+
+    fwCaptureClose(fws);
+    fws->capture_log = fd;
+    fws->capture_size = ring_size;
+#if defined(IS_LINUX)
+    if (fd != -1 && pipe(fws->capture_pipe) == 0) {
+        fcntl(fws->capture_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fws->capture_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return 0;
+}
+
+void fwSetLineCallback(fwState *fws, fwLineCallback *cb, void *data) {
+    fws->line_cb = cb;
+    fws->line_data = data;
+}
+
+/* Copy out up to 'len' of the most recent bytes the latest job of 'rule_id'
+ * wrote to 'stream'. 'dropped' is set to how much did not fit in the ring */
+size_t fwJobGetOutput(fwState *fws, int rule_id, int stream, char *buf,
+                      size_t len, unsigned long long *dropped) {
+    fwStream *st;
+    fwRing *ring;
+    size_t avail, start, first;
+
+    if (rule_id < 0 || rule_id >= fws->rules_count ||
+        (stream != FW_STDOUT && stream != FW_STDERR) ||
+        (st = fws->rules[rule_id].output[stream]) == NULL) {
+        return 0;
+    }
+
+    ring = &st->ring;
+    avail = ring->total < ring->size ? ring->total : ring->size;
+    if (len > avail) {
+        len = avail;
+    }
+    if (dropped) {
+        *dropped = ring->dropped;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    start = (ring->total - len) % ring->size;
+    first = ring->size - start < len ? ring->size - start : len;
+    memcpy(buf, ring->buf + start, first);
+    memcpy(buf + first, ring->buf, len - first);
+    return len;
+}
+
+static void fwStreamRelease(fwStream *st) {
+    if (st && --st->refs == 0) {
+        free(st->ring.buf);
+        free(st);
+    }
+}
+
+static void fwRingWrite(fwRing *ring, char *buf, size_t len) {
+    unsigned long long before, after;
+    size_t pos, first;
+
+    if (ring->size == 0) {
+        return;
+    }
+
+    before = ring->total > ring->size ? ring->total - ring->size : 0;
+    ring->total += len;
+    after = ring->total > ring->size ? ring->total - ring->size : 0;
+    ring->dropped += after - before;
+
+    /* Only the tail can survive */
+    if (len > ring->size) {
+        buf += len - ring->size;
+        len = ring->size;
+    }
+
+    pos = (ring->total - len) % ring->size;
+    first = ring->size - pos < len ? ring->size - pos : len;
+    memcpy(ring->buf + pos, buf, first);
+    memcpy(ring->buf, buf + first, len - first);
+}
+
+static void fwStreamEmitLine(fwState *fws, fwStream *st) {
+    if (fws->line_cb && st->line_len) {
+        fws->line_cb(fws, st->rule, st->pid, st->stream, st->line,
+                     st->line_len, fws->line_data);
+    }
+    st->line_len = 0;
+}
+
+static void fwStreamFrame(fwState *fws, fwStream *st, char *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (buf[i] == '\n') {
+            fwStreamEmitLine(fws, st);
+            continue;
+        }
+        st->line[st->line_len++] = buf[i];
+        if (st->line_len == FW_LINE_MAX) {
+            fwStreamEmitLine(fws, st);
+        }
+    }
+}
+
+static void fwStreamClose(fwState *fws, fwStream *st) {
+    if (st->fd != -1) {
+        fwLoopSetIo(fws, st->fd, 0, NULL, NULL);
+        close(st->fd);
+        st->fd = -1;
+        fwStreamEmitLine(fws, st);
+    }
+}
+
+#if defined(IS_LINUX)
+/* Move the 'len' bytes teed into the capture pipe on to the log. On
+ * failure they are read back out so the pipe stays empty, and output is
+ * written from then on */
+static void fwCaptureSplice(fwState *fws, size_t len) {
+    char chunk[4096];
+    ssize_t moved;
+
+    while (len > 0) {
+        moved = splice(fws->capture_pipe[0], NULL, fws->capture_log, NULL, len,
+                       SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        } else if (moved <= 0) {
+            break;
+        }
+        len -= moved;
+    }
+
+    if (len > 0) {
+        fwWarn("Cannot splice into the log: %s\n", strerror(errno));
+        while (len > 0 && (moved = read(fws->capture_pipe[0], chunk,
+                                        len < sizeof(chunk) ? len
+                                                            : sizeof(chunk))) >
+                                  0) {
+            if (write(fws->capture_log, chunk, moved) != moved) {
+                fwDebug("Log write failed: %s\n", strerror(errno));
+            }
+            len -= moved;
+        }
+        close(fws->capture_pipe[0]);
+        close(fws->capture_pipe[1]);
+        fws->capture_pipe[0] = fws->capture_pipe[1] = -1;
+    }
+}
+#endif
+
+/* Read at most 'budget' bytes into the ring and the line framing, closing
+ * the stream once the job has closed its end. With a log the same bytes are
+ * teed to it first, so it never has to be copied through us */
+static void fwStreamDrain(fwState *fws, fwStream *st, size_t budget) {
+    char chunk[16 * 1024];
+    size_t want;
+    ssize_t len = 0, teed;
+
+    while (budget > 0 && st->fd != -1) {
+        want = budget < sizeof(chunk) ? budget : sizeof(chunk);
+        teed = 0;
+#if defined(IS_LINUX)
+        /* The capture pipe is empty between calls, so this only stops for
+         * want of output */
+        if (fws->capture_pipe[1] != -1) {
+            teed = tee(st->fd, fws->capture_pipe[1], want, SPLICE_F_NONBLOCK);
+            if (teed > 0) {
+                want = teed;
+            } else if (teed == -1 && errno != EAGAIN && errno != EINTR) {
+                fwDebug("Cannot tee into the log: %s\n", strerror(errno));
+                close(fws->capture_pipe[0]);
+                close(fws->capture_pipe[1]);
+                fws->capture_pipe[0] = fws->capture_pipe[1] = -1;
+            }
+            teed = teed > 0 ? teed : 0;
+        }
+#endif
+        len = read(st->fd, chunk, want);
+        if (len > 0) {
+            fwRingWrite(&st->ring, chunk, len);
+            fwStreamFrame(fws, st, chunk, len);
+        }
+#if defined(IS_LINUX)
+        if (teed) {
+            fwCaptureSplice(fws, teed);
+        } else
+#endif
+        if (len > 0 && fws->capture_log != -1 &&
+            write(fws->capture_log, chunk, len) != len) {
+            fwDebug("Log write failed: %s\n", strerror(errno));
+        }
+
+        if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+            fwStreamClose(fws, st);
+        } else if (len == -1) {
+            return;
+        } else {
+            budget -= (size_t)len < budget ? (size_t)len : budget;
+        }
+    }
+}
+
+static void fwStreamReady(fwState *fws, int fd, void *data, int mask) {
+    fwStreamDrain(fws, data, FW_CAPTURE_BUDGET);
+}
+
+/* Create the pipe for one stream of a job, 'wfd' is the end for the job */
+static fwStream *fwStreamNew(fwState *fws, int rule_id, int stream, int *wfd) {
+    fwStream *st;
+    int fds[2];
+
+    if ((st = calloc(1, sizeof(fwStream))) == NULL) {
+        return NULL;
+    }
+
+    if (fws->capture_size &&
+        (st->ring.buf = malloc(fws->capture_size)) == NULL) {
+        free(st);
+        return NULL;
+    }
+
+    if (pipe(fds) == -1) {
+        free(st->ring.buf);
+        free(st);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    st->fd = fds[0];
+    st->rule = rule_id;
+    st->stream = stream;
+    st->ring.size = fws->capture_size;
+    st->refs = 1;
+    *wfd = fds[1];
+    return st;
+}
+
+/* The job has started, serve its output from the loop and make it the
+ * latest output of the rule */
+static void fwStreamAttach(fwState *fws, fwJob *job, int stream) {
+    fwRule *rule = &fws->rules[job->rule];
+    fwStream *st = job->out[stream];
+
+    st->pid = job->pid;
+    if (fwLoopSetIo(fws, st->fd, FW_IO_READ, fwStreamReady, st) == FW_EVT_ERR) {
+        fwStreamClose(fws, st);
+    }
+    fwStreamRelease(rule->output[stream]);
+    rule->output[stream] = st;
+    st->refs++;
+}
+
+/* How long a job gets to exit after SIGTERM before it gets SIGKILL */
+#define FW_JOB_GRACE_MS 3000
+/* How often a job the loop cannot watch is checked for having exited */
+#define FW_JOB_POLL_MS 100
+
+/* 1 once 'job' has exited and is reaped, never waits */
+static int fwJobReap(fwJob *job) {
+    pid_t rc = waitpid(job->pid, NULL, WNOHANG);
+    /* ECHILD means someone else reaped it */
+    return rc == job->pid || (rc == -1 && errno == ECHILD);
+}
+
+/* Free the slot of a reaped job */
+static void fwJobFinish(fwState *fws, fwJob *job) {
+    fwRule *rule = &fws->rules[job->rule];
+
+    fwTraceSpanFlow(job, job->started, job->pid, job->flow, FW_FLOW_END);
+    for (int i = 0; i < 2; ++i) {
+        if (job->out[i]) {
+            /* Whatever is still in the pipe, anything the job left running
+             * can no longer be heard */
+            fwStreamDrain(fws, job->out[i], FW_CAPTURE_BUDGET);
+            fwStreamClose(fws, job->out[i]);
+            fwStreamRelease(job->out[i]);
+            job->out[i] = NULL;
+        }
+    }
+    if (job->pidfd != -1) {
+        fwLoopSetIo(fws, job->pidfd, 0, NULL, NULL);
+        close(job->pidfd);
+    }
+    fwDebug("Job finished: pid=%d rule=%d\n", job->pid, job->rule);
+    job->pid = -1;
+    job->pidfd = -1;
+    job->watched = 0;
+    job->stopping = 0;
+    job->kill_at = 0;
+    rule->running--;
+    fws->jobs_running--;
+}
+
+static void fwJobExited(fwState *fws, pid_t pid) {
+    for (int i = 0; i < fws->jobs_cap; ++i) {
+        if (fws->jobs[i].pid == pid) {
+            if (!fwJobReap(&fws->jobs[i])) {
+                return;
+            }
+            fwJobFinish(fws, &fws->jobs[i]);
+            /* A slot has freed up */
+            fwJobsSchedule(fws);
+            return;
+        }
+    }
+}
+
+/* Ask the jobs of 'rule_id', or all jobs if it is -1, to terminate. The
+ * command runs in its own process group so everything it started goes too.
+ * Their slots are freed when they exit, those still running after
+ * FW_JOB_GRACE_MS get SIGKILL */
+static void fwJobsKill(fwState *fws, int rule_id) {
+    uint64_t kill_at = fwMonotonicNs() / 1000000 + FW_JOB_GRACE_MS;
+
+    for (int i = 0; i < fws->jobs_cap; ++i) {
+        fwJob *job = &fws->jobs[i];
+        if (job->pid != -1 && !job->stopping &&
+            (rule_id == -1 || job->rule == rule_id)) {
+            kill(-job->pid, SIGTERM); // Use SIGTERM to allow child to cleanup
+            job->stopping = 1;
+            job->kill_at = kill_at;
+        }
+    }
+}
+
+/* Reap the jobs the loop does not watch, every job with 'all', and SIGKILL
+ * those past their grace. Returns how many were reaped */
+static int fwJobsCheck(fwState *fws, int all) {
+    uint64_t now = fwMonotonicNs() / 1000000;
+    int reaped = 0;
+
+    for (int i = 0; i < fws->jobs_cap; ++i) {
+        fwJob *job = &fws->jobs[i];
+        if (job->pid == -1) {
+            continue;
+        }
+        if ((all || !job->watched) && fwJobReap(job)) {
+            fwJobFinish(fws, job);
+            reaped++;
+        } else if (job->stopping == 1 && now >= job->kill_at) {
+            fwDebug("Job ignored SIGTERM: pid=%d\n", job->pid);
+            kill(-job->pid, SIGKILL);
+            job->stopping = 2;
+        }
+    }
+    return reaped;
+}
+
+/* 'timeout' cut short for the next job deadline */
+static int fwJobsTimeout(fwState *fws, int timeout) {
+    uint64_t now = 0;
+    int wait;
+
+    for (int i = 0; i < fws->jobs_cap && fws->jobs_running; ++i) {
+        fwJob *job = &fws->jobs[i];
+        if (job->pid == -1) {
+            continue;
+        } else if (!job->watched) {
+            wait = FW_JOB_POLL_MS;
+        } else if (job->stopping == 1) {
+            now = now ? now : fwMonotonicNs() / 1000000;
+            wait = job->kill_at > now ? job->kill_at - now : 0;
+        } else {
+            continue;
+        }
+        if (timeout == -1 || wait < timeout) {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+/* Nothing reaps the jobs once the loop is gone, stop them and wait for
+ * them. After SIGKILL and another grace period they are given up on */
+static void fwJobsStop(fwState *fws) {
+    uint64_t give_up = fwMonotonicNs() / 1000000 + 2 * FW_JOB_GRACE_MS;
+
+    fwJobsKill(fws, -1);
+    while (fws->jobs_running) {
+        fwJobsCheck(fws, 1);
+        if (fws->jobs_running == 0) {
+            break;
+        } else if (fwMonotonicNs() / 1000000 >= give_up) {
+            fwWarn("%d jobs did not exit\n", fws->jobs_running);
+            break;
+        }
+        usleep(10 * 1000);
+    }
+}
+
+/* The job gets FW_CLOCK, FW_SINCE (the clock when the rule last started a
+ * job) and FW_CHANGED, the newline separated files matching the rule that
+ * changed in between. The same list is readable from stdin, which is the
+ * only place to find it when FW_CHANGED_TRUNCATED is set */
+extern char **environ;
+
+/* Variables a job gets from us, left out if we were started with them */
+static const char *fw_job_vars[] = {"FW_CLOCK=", "FW_SINCE=", "FW_CHANGED=",
+                                    "FW_CHANGED_TRUNCATED=", "FW_TARGETS="};
+#define FW_JOB_VARS (sizeof(fw_job_vars) / sizeof(fw_job_vars[0]))
+
+static char *fwJobEnvVar(const char *prefix, const char *value) {
+    size_t len = strlen(prefix), vlen = strlen(value);
+    char *var;
+
+    if ((var = malloc(len + vlen + 1)) != NULL) {
+        memcpy(var, prefix, len);
+        memcpy(var + len, value, vlen + 1);
+    }
+    return var;
+}
+
+static int fwJobEnvOwn(const char *var) {
+    for (size_t k = 0; k < FW_JOB_VARS; ++k) {
+        if (!strncmp(var, fw_job_vars[k], strlen(fw_job_vars[k]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Only the variables we made are freed, the rest belong to environ */
+static void fwJobEnvFree(char **env) {
+    for (char **e = env; *e; ++e) {
+        if (fwJobEnvOwn(*e)) {
+            free(*e);
+        }
+    }
+    free(env);
+}
+
+/* Our environment with the variables describing the job's changes. Built
+ * before fork, as the child of a threaded process may only make async
+ * signal safe calls */
+static char **fwJobEnv(fwChangedArgs *changed, const char *clock,
+                       const char *since) {
+    size_t count = 0, n = 0;
+    char **env;
+
+    for (char **e = environ; *e; ++e) {
+        count++;
+    }
+    if ((env = calloc(count + FW_JOB_VARS + 1, sizeof(char *))) == NULL) {
+        return NULL;
+    }
+
+    for (char **e = environ; *e; ++e) {
+        if (!fwJobEnvOwn(*e)) {
+            env[n++] = *e;
+        }
+    }
+    env[n++] = fwJobEnvVar("FW_CLOCK=", clock);
+    env[n++] = fwJobEnvVar("FW_SINCE=", since);
+    if (!changed->truncated) {
+        env[n++] = fwJobEnvVar("FW_CHANGED=", changed->buf);
+    } else {
+        /* Told apart from nothing having changed, stdin has it all */
+        env[n++] = fwJobEnvVar("FW_CHANGED_TRUNCATED=", "1");
+    }
+    if (changed->targets) {
+        env[n++] = fwJobEnvVar("FW_TARGETS=", changed->targets);
+    }
+
+    /* Allocation failed part way, what follows the hole is ours */
+    for (size_t k = 0; k < n; ++k) {
+        if (env[k] == NULL) {
+            for (++k; k < n; ++k) {
+                free(env[k]);
+            }
+            fwJobEnvFree(env);
+            return NULL;
+        }
+    }
+    return env;
+}
+
+static int fwJobStart(fwState *fws, int rule_id) {
+    fwRule *rule = &fws->rules[rule_id];
+    fwChangedArgs changed = {0};
+    char clock[32], since[32];
+    char **env;
+    int wfds[2] = {-1, -1};
+    uint64_t start = fwTraceStart();
+    fwJob *job = NULL;
+    pid_t pid;
+
+    for (int i = 0; i < fws->jobs_cap && !job; ++i) {
+        if (fws->jobs[i].pid == -1) {
+            job = &fws->jobs[i];
+        }
+    }
+
+    if (job == NULL || fws->jobs_running >= fws->max_jobs) {
+        return -1;
+    }
+
+    snprintf(clock, sizeof(clock), "%llu", fws->clock);
+    snprintf(since, sizeof(since), "%llu", rule->since);
+    changed.rule = rule;
+    changed.list = tmpfile();
+    if ((changed.buf = malloc(FW_CHANGED_MAX)) != NULL) {
+        changed.buf[0] = '\0';
+    } else {
+        changed.truncated = 1;
+    }
+    if (rule->deps) {
+        if ((changed.targets = malloc(FW_CHANGED_MAX)) != NULL) {
+            changed.targets[0] = '\0';
+        }
+        if (fws->deps) {
+            fws->deps->query++;
+        }
+    }
+    fwQuerySince(fws, rule->since, fwChangedAppend, &changed);
+    if (changed.list) {
+        fflush(changed.list);
+        rewind(changed.list);
+    }
+
+    /* The dependencies changed since it was marked, nothing to build */
+    if (rule->deps && changed.targets_count == 0) {
+        if (changed.list) {
+            fclose(changed.list);
+        }
+        free(changed.buf);
+        free(changed.targets);
+        rule->pending = 0;
+        rule->since = fws->clock;
+        return 0;
+    }
+
+    if ((env = fwJobEnv(&changed, clock, since)) == NULL) {
+        if (changed.list) {
+            fclose(changed.list);
+        }
+        free(changed.buf);
+        free(changed.targets);
+        return -1;
+    }
+
+    if (fws->capture_size || fws->capture_log != -1) {
+        for (int i = 0; i < 2; ++i) {
+            if ((job->out[i] = fwStreamNew(fws, rule_id, i, &wfds[i])) == NULL) {
+                fwWarn("Cannot capture output, sharing ours\n");
+            }
+        }
+    }
+
+    if ((pid = fork()) == 0) {
+        /* The loop blocks these to read them itself, the command should
+         * get the default behaviour back */
+        sigprocmask(SIG_UNBLOCK, &fws->sigmask, NULL);
+        setpgid(0, 0);
+        if (changed.list) {
+            dup2(fileno(changed.list), STDIN_FILENO);
+        }
+        if (wfds[FW_STDOUT] != -1) {
+            dup2(wfds[FW_STDOUT], STDOUT_FILENO);
+        }
+        if (wfds[FW_STDERR] != -1) {
+            dup2(wfds[FW_STDERR], STDERR_FILENO);
+        }
+        execle("/bin/sh", "sh", "-c", rule->command, (char *)NULL, env);
+        _exit(127);
+    }
+
+    if (changed.list) {
+        fclose(changed.list);
+    }
+    free(changed.buf);
+    free(changed.targets);
+    fwJobEnvFree(env);
+
+    for (int i = 0; i < 2; ++i) {
+        if (wfds[i] != -1) {
+            close(wfds[i]);
+        }
+    }
+
+    if (pid == -1) {
+        for (int i = 0; i < 2; ++i) {
+            if (job->out[i]) {
+                fwStreamClose(fws, job->out[i]);
+                fwStreamRelease(job->out[i]);
+                job->out[i] = NULL;
+            }
+        }
+        return -1;
+    }
+
+    /* Also set here so a kill straight after the fork reaches the group */
+    setpgid(pid, pid);
+    job->pid = pid;
+    job->rule = rule_id;
+    job->started = start;
+    rule->running++;
+    rule->pending = 0;
+    rule->since = fws->clock;
+    fws->jobs_running++;
+
+    for (int i = 0; i < 2; ++i) {
+        if (job->out[i]) {
+            fwStreamAttach(fws, job, i);
+        }
+    }
+
+    job->flow = fws->flow;
+    fwTraceSpanFlow(spawn, start, pid, job->flow, FW_FLOW_STEP);
+    if (fwJobWatch(fws, job) == -1) {
+        fwWarn("Cannot watch job %d, polling for it\n", pid);
+    } else {
+        job->watched = 1;
+    }
+    return 0;
+}
+
+/* 1 if the changes pending for a rule using dependencies still build a
+ * target, a .d file may have taken them out since it was marked */
+static int fwJobsHasTargets(fwState *fws, fwRule *rule) {
+    fwChangedArgs changed = {.rule = rule, .truncated = 1};
+
+    if (fws->deps) {
+        fws->deps->query++;
+    }
+    fwQuerySince(fws, rule->since, fwChangedAppend, &changed);
+    return changed.targets_count > 0;
+}
+
+/* Start a job for every rule with pending changes that its policy allows,
+ * rules that cannot get a slot keep their changes for the next attempt */
+static void fwJobsSchedule(fwState *fws) {
+    int pending = 0;
+
+    if (!fws->jobs_pending || fws->replaying) {
+        return;
+    }
+
+    for (int n = 0; n < fws->rules_count; ++n) {
+        /* Rotate the starting rule so none can hog the slots */
+        int i = (fws->rule_next + n) % fws->rules_count;
+        fwRule *rule = &fws->rules[i];
+
+        if (!rule->pending) {
+            continue;
+        }
+
+        /* The new job starts once the old one is gone, see fwJobExited.
+         * Changes that build nothing are not worth stopping it for */
+        if (rule->running && rule->policy == FW_JOB_RESTART) {
+            if (rule->deps && !fwJobsHasTargets(fws, rule)) {
+                rule->pending = 0;
+                rule->since = fws->clock;
+                continue;
+            }
+            fwJobsKill(fws, i);
+            pending = 1;
+            continue;
+        }
+
+        if ((rule->running && rule->policy == FW_JOB_QUEUE) ||
+            fwJobStart(fws, i) == -1) {
+            pending = 1;
+        }
+    }
+
+    fws->rule_next = fws->rules_count ? (fws->rule_next + 1) % fws->rules_count
+                                      : 0;
+    fws->jobs_pending = pending;
+}
+
+/*============================================================================
+ * BLOCK MAPS
+ *============================================================================*/
+
+/* Files with fewer blocks than this per thread are hashed on the loop */
+#define FW_BLOCKS_PER_THREAD 256
+#define FW_BLOCKS_THREADS_MAX 16
+/* Most blocks read for one update or one step between polls, 64MiB, so a
+ * large file cannot hold up the loop for long */
+#define FW_BLOCKS_STEP 1024
+
+#define FW_HASH_P1 0x9E3779B185EBCA87ull
+#define FW_HASH_P2 0xC2B2AE3D27D4EB4Full
+
+#define fwRotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Four independent lanes over 32 byte stripes, the same shape as xxh64, so
+ * the compiler can keep them in vector registers */
+static uint64_t fwHashBlock(const unsigned char *p, size_t len) {
+    uint64_t acc[4] = {FW_HASH_P1 + FW_HASH_P2, FW_HASH_P2, 0, -FW_HASH_P1};
+    uint64_t v, h;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; ++l) {
+            memcpy(&v, p + i + l * 8, sizeof(v));
+            acc[l] = fwRotl64(acc[l] + v * FW_HASH_P2, 31) * FW_HASH_P1;
+        }
+    }
+
+    h = fwRotl64(acc[0], 1) + fwRotl64(acc[1], 7) + fwRotl64(acc[2], 12) +
+        fwRotl64(acc[3], 18) + len;
+    for (; i < len; ++i) {
+        h = (h ^ p[i]) * FW_HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= FW_HASH_P2;
+    h ^= h >> 29;
+    return h;
+}
+
+/* Blocks [from, to) of the file open on 'fd' */
+typedef struct fwBlockRange {
+    fwBlockMap *map;
+    int fd;
+    size_t from;
+    size_t to;
+    /* Blocks with a hash to compare against, anything after is new */
+    size_t old_valid;
+    /* A read failed, the hashes of the range cannot be trusted */
+    int failed;
+} fwBlockRange;
+
+/* Ranges start on a multiple of 64 blocks so each thread owns whole words
+ * of the dirty bitmap. Blocks are read rather than mapped, so a file
+ * truncated meanwhile hashes short instead of raising SIGBUS */
+static void *fwBlocksHashRange(void *data) {
+    fwBlockRange *r = data;
+    fwBlockMap *map = r->map;
+    unsigned char *buf;
+    ssize_t len;
+    uint64_t h;
+
+    if ((buf = malloc(FW_BLOCK_SIZE)) == NULL) {
+        r->failed = 1;
+        return NULL;
+    }
+
+    for (size_t b = r->from; b < r->to; ++b) {
+        do {
+            len = pread(r->fd, buf, FW_BLOCK_SIZE,
+                        (off_t)b * FW_BLOCK_SIZE);
+        } while (len == -1 && errno == EINTR);
+        if (len == -1) {
+            r->failed = 1;
+            break;
+        }
+
+        h = fwHashBlock(buf, len);
+        if (b >= r->old_valid || h != map->hashes[b]) {
+            map->hashes[b] = h;
+            map->dirty[b / 64] |= 1ull << (b % 64);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Hash blocks [from, to) of 'fw' across threads, comparing those below
+ * 'old_valid' with their previous hash */
+static int fwBlocksHash(fwFile *fw, size_t from, size_t to,
+                        size_t old_valid) {
+    fwBlockMap *map = fw->blocks;
+    fwBlockRange ranges[FW_BLOCKS_THREADS_MAX];
+    pthread_t threads[FW_BLOCKS_THREADS_MAX];
+    int nthreads, started = 0, failed = 0;
+    size_t lo, step;
+    int fd;
+
+    if ((fd = open(fw->name, O_RDONLY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    (void)posix_fadvise(fd, (off_t)from * FW_BLOCK_SIZE,
+                        (off_t)(to - from) * FW_BLOCK_SIZE,
+                        POSIX_FADV_SEQUENTIAL);
+
+    nthreads = (to - from) / FW_BLOCKS_PER_THREAD;
+    if (nthreads > sysconf(_SC_NPROCESSORS_ONLN)) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > FW_BLOCKS_THREADS_MAX) {
+        nthreads = FW_BLOCKS_THREADS_MAX;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    step = ((to - from) / nthreads + 63) & ~(size_t)63;
+    lo = from & ~(size_t)63;
+
+    for (int i = 0; i < nthreads; ++i) {
+        fwBlockRange *r = &ranges[i];
+
+        r->map = map;
+        r->fd = fd;
+        r->from = i ? lo + step * i : from;
+        r->to = i == nthreads - 1 ? to : lo + step * (i + 1);
+        r->old_valid = old_valid;
+        r->failed = 0;
+        if (r->to > to) {
+            r->to = to;
+        }
+        if (r->from >= r->to) {
+            nthreads = i;
+            break;
+        }
+
+        /* The last range is hashed here rather than on a thread */
+        if (r->to == to ||
+            pthread_create(&threads[started], NULL, fwBlocksHashRange, r) !=
+                    0) {
+            fwBlocksHashRange(r);
+        } else {
+            started++;
+        }
+    }
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        failed |= ranges[i].failed;
+    }
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+/* Hash the rest of 'fw' between polls */
+static int fwBlocksDefer(fwState *fws, fwFile *fw) {
+    int *ids;
+
+    for (int i = 0; i < fws->blocks_pending_count; ++i) {
+        if (fws->blocks_pending[i] == fw->id) {
+            return 0;
+        }
+    }
+
+    if (fws->blocks_pending_count == fws->blocks_pending_cap) {
+        int cap = fws->blocks_pending_cap ? fws->blocks_pending_cap * 2 : 8;
+        if ((ids = realloc(fws->blocks_pending, sizeof(int) * cap)) ==
+            NULL) {
+            return -1;
+        }
+        fws->blocks_pending = ids;
+        fws->blocks_pending_cap = cap;
+    }
+    fws->blocks_pending[fws->blocks_pending_count++] = fw->id;
+    return 0;
+}
+
+/* Compare up to FW_BLOCKS_STEP blocks from 'map->next' with their stored
+ * hash, setting the dirty bit of those that differ. Every block is dirty
+ * when the file cannot be read */
+static int fwBlocksStep(fwFile *fw) {
+    fwBlockMap *map = fw->blocks;
+    size_t end = map->count - map->next > FW_BLOCKS_STEP
+                         ? map->next + FW_BLOCKS_STEP
+                         : map->count;
+
+    if (map->next < end &&
+        fwBlocksHash(fw, map->next, end, map->valid) == -1) {
+        memset(map->dirty, 0xff, sizeof(uint64_t) * ((map->count + 63) / 64));
+        map->valid = 0;
+        map->next = map->count;
+        return -1;
+    }
+    map->valid = end > map->valid ? end : map->valid;
+    map->next = end;
+    return 0;
+}
+
+/* Rehash whatever may have changed. Files that are only appended to and
+ * have not shrunk have the blocks from the old end onwards hashed, anything
+ * else is hashed in full as mtime is too coarse to skip it. Past
+ * FW_BLOCKS_STEP blocks the rest is compared between polls, and the dirty
+ * bits are only handed out once it is done. Until then changes add to
+ * them. When the file cannot be read every block is reported changed */
+static int fwBlocksUpdate(fwState *fws, fwFile *fw, struct stat *sb) {
+    fwBlockMap *map = fw->blocks;
+    long long size = sb->st_size;
+    size_t count, first = 0, words;
+    int pending = map->next < map->count;
+    uint64_t *buf;
+
+    count = (size + FW_BLOCK_SIZE - 1) / FW_BLOCK_SIZE;
+    if (count > map->cap) {
+        if ((buf = realloc(map->hashes, sizeof(uint64_t) * count)) != NULL) {
+            map->hashes = buf;
+            buf = realloc(map->dirty, sizeof(uint64_t) * ((count + 63) / 64));
+        }
+        if (buf == NULL) {
+            memset(map->dirty, 0xff, sizeof(uint64_t) * ((map->cap + 63) / 64));
+            map->count = map->next = map->cap;
+            map->valid = 0;
+            return -1;
+        }
+        map->dirty = buf;
+        map->cap = count;
+    }
+
+    /* Held bits are kept, words new to the file start clean */
+    words = (count + 63) / 64;
+    if (!pending) {
+        memset(map->dirty, 0, sizeof(uint64_t) * words);
+    } else if (count > map->count) {
+        memset(map->dirty + (map->count + 63) / 64, 0,
+               sizeof(uint64_t) * (words - (map->count + 63) / 64));
+    }
+
+    if ((map->flags & FW_BLOCKS_APPEND) && size >= map->size) {
+        first = map->size / FW_BLOCK_SIZE;
+    }
+    if (pending && first > map->next) {
+        first = map->next;
+    }
+    if (first > map->valid) {
+        first = map->valid;
+    }
+    if (map->valid > count) {
+        map->valid = count;
+    }
+
+    map->count = count;
+    map->size = size;
+    map->next = first;
+    map->report = 1;
+    if (fwBlocksStep(fw) == -1) {
+        return -1;
+    }
+
+    /* Without a place in the queue it is hashed here after all */
+    if (map->next < count && fwBlocksDefer(fws, fw) == -1) {
+        while (map->next < count) {
+            if (fwBlocksStep(fw) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* The change to 'fw' again, now that its dirty bits are known, as a batch
+ * of its own */
+static void fwBlocksReport(fwState *fws, fwFile *fw) {
+    fwBatchEvt evt = {fw->wd, fw->id, fw->changed_mask, 0, "",
+                      fw->changed_at};
+
+    for (int i = 0; i < FW_BATCH_SUBS_MAX; ++i) {
+        if (fws->subs[i].cb) {
+            fws->subs[i].cb(fws, &evt, 1, fws->subs[i].data);
+        }
+    }
+}
+
+/* One FW_BLOCKS_STEP of the first file still being hashed */
+static void fwBlocksContinue(fwState *fws) {
+    fwFile *fw = fws->files_array[fws->blocks_pending[0]];
+    fwBlockMap *map = fw->blocks;
+
+    if (map == NULL || fw->deleted) {
+        if (map) {
+            map->next = map->count;
+        }
+    } else if (map->next < map->count) {
+        fwBlocksStep(fw);
+        if (map->next < map->count) {
+            return;
+        }
+        if (map->report) {
+            fwBlocksReport(fws, fw);
+        } else {
+            /* Only just attached, nothing has changed yet */
+            memset(map->dirty, 0, sizeof(uint64_t) * ((map->count + 63) / 64));
+        }
+    }
+
+    memmove(fws->blocks_pending, fws->blocks_pending + 1,
+            sizeof(int) * --fws->blocks_pending_count);
+}
+
+static void fwBlocksRelease(fwBlockMap *map) {
+    if (map) {
+        free(map->hashes);
+        free(map->dirty);
+        free(map);
+    }
+}
+
+/* Hash the whole of 'fw' if a block rule matches it */
+static void fwBlocksAttach(fwState *fws, fwFile *fw) {
+    struct stat sb;
+    int i;
+
+    for (i = 0; i < fws->block_rules_count; ++i) {
+        if (fnmatch(fws->block_rules[i].pattern, fw->name, 0) == 0) {
+            break;
+        }
+    }
+
+    if (fw->blocks || i == fws->block_rules_count ||
+        stat(fw->name, &sb) == -1) {
+        return;
+    }
+
+    if ((fw->blocks = calloc(1, sizeof(fwBlockMap))) == NULL) {
+        return;
+    }
+    fw->blocks->flags = fws->block_rules[i].flags;
+
+    if (fwBlocksUpdate(fws, fw, &sb) == -1) {
+        fwWarn("Cannot hash blocks of: %s\n", fw->name);
+        fwBlocksRelease(fw->blocks);
+        fw->blocks = NULL;
+        return;
+    }
+
+    /* Nothing has changed yet */
+    fw->blocks->report = 0;
+    memset(fw->blocks->dirty, 0,
+           sizeof(uint64_t) * ((fw->blocks->count + 63) / 64));
+}
+
+/* Keep a hash of every FW_BLOCK_SIZE block of the files matching 'pattern',
+ * including files already added, so a change reports which blocks differ */
+int fwAddBlockMap(fwState *fws, char *pattern, int flags) {
+    fwBlockRule *rules;
+
+    rules = realloc(fws->block_rules,
+                    sizeof(fwBlockRule) * (fws->block_rules_count + 1));
+    if (rules == NULL) {
+        return -1;
+    }
+    fws->block_rules = rules;
+    rules[fws->block_rules_count].pattern = strdup(pattern);
+    rules[fws->block_rules_count].flags = flags;
+    fws->block_rules_count++;
+
+    for (int i = 0; i < fws->files_count; ++i) {
+        fwBlocksAttach(fws, fws->files_array[i]);
+    }
+    return 0;
+}
+
+/* A bit per block that changed in the file's last change, valid until the
+ * next poll. NULL if the file has no block map, or is still being hashed
+ * and will be handed to batch subscribers again once it is done */
+const uint64_t *fwLoopGetBlocks(fwState *fws, int path_id, size_t *count) {
+    fwBlockMap *map;
+
+    if (path_id < 0 || path_id >= fws->files_count ||
+        (map = fws->files_array[path_id]->blocks) == NULL ||
+        map->next < map->count) {
+        return NULL;
+    }
+    *count = map->count;
+    return map->dirty;
+}
+
+static void fwFileSettle(fwState *fws, fwFile *fw);
+static fwDir *fwDirWatch(fwState *fws, const char *path, int flags,
+                         char *ext, int extlen);
+
+/* Watch whatever 'fw->name' is now, dropping the watch on what it was */
+static int fwFileWatch(fwState *fws, fwFile *fw) {
+    struct stat sb;
+    int other;
+
+    if (fw->wd != -1) {
+        fwLoopDeleteEvent(fws, fw->wd, FW_EVT_WATCH);
+        fw->wd = -1;
+    }
+    if (fw->fd != -1) {
+        close(fw->fd);
+    }
+    if (fwIdMapGet(&fws->file_inodes, fw->dev, fw->ino) == fw->id) {
+        fwIdMapDel(&fws->file_inodes, fw->dev, fw->ino);
+    }
+
+    if ((fw->fd = open(fw->name, OPEN_FILE_FLAGS | O_CLOEXEC, 0644)) == -1) {
+        return -1;
+    }
+
+    if (fstat(fw->fd, &sb) == -1) {
+        goto error;
+    }
+
+    /* The inode was renamed here from another watched name, whose events
+     * saying so are still on their way */
+    if ((other = fwIdMapGet(&fws->file_inodes, sb.st_dev, sb.st_ino)) != -1) {
+        fwFileSettle(fws, fws->files_array[other]);
+    }
+
+    if ((fw->wd = fwLoopAddWatch(fws, fw->fd, FW_EVT_WATCH, fwListener, fw)) ==
+        FW_EVT_ERR) {
+        fwDebug("Failed to add event: filename=%s reason: %s\n", fw->name,
+                strerror(errno));
+        goto error;
+    }
+#if defined(IS_LINUX)
+    /* inotify watches by path, fwLoopAddWatch has closed the descriptor */
+    fw->fd = -1;
+#endif
+
+    fw->dev = sb.st_dev;
+    fw->ino = sb.st_ino;
+    if (fwIdMapPut(&fws->file_inodes, fw->dev, fw->ino, fw->id) == -1) {
+        fwWarn("Cannot index the inode of: %s\n", fw->name);
+    }
+    return 0;
+
+error:
+    close(fw->fd);
+    fw->fd = -1;
+    fw->wd = -1;
+    return -1;
+}
+
+/* The file no longer exists, it is kept so queries can report it and its
+ * directory watch brings it back if the name reappears */
+static void fwFileGone(fwState *fws, fwFile *fw) {
+    fwDebug("DELETED: %s\n", fw->name);
+    if (fw->wd != -1) {
+        fwLoopDeleteEvent(fws, fw->wd, FW_EVT_WATCH);
+        fw->wd = -1;
+    }
+    if (fw->fd != -1) {
+        close(fw->fd);
+        fw->fd = -1;
+    }
+    if (fwIdMapGet(&fws->file_inodes, fw->dev, fw->ino) == fw->id) {
+        fwIdMapDel(&fws->file_inodes, fw->dev, fw->ino);
+    }
+    fw->deleted = 1;
+    if (fw->dep_file != -1) {
+        fwDepsReload(fws, fw);
+    }
+}
+
+/* Pick up the new contents of 'fw' and let the rules know */
+static void fwFileRefresh(fwState *fws, fwFile *fw) {
+    struct stat sb;
+
+    if (stat(fw->name, &sb) == -1) {
+        fwWarn("Could not update stats for file: %s\n", fw->name);
+        return;
+    }
+
+    if (fw->blocks && fwBlocksUpdate(fws, fw, &sb) == -1) {
+        fwWarn("Cannot hash blocks of: %s\n", fw->name);
+    }
+    if (fw->dep_file != -1) {
+        fwDepsReload(fws, fw);
+    }
+    fw->size = sb.st_size;
+    fw->last_update = statFileUpdated(sb);
+    fwJobsMark(fws, fw);
+}
+
+/* Bring 'fw' up to date with what its name refers to now, without waiting
+ * for the events about it */
+static void fwFileSettle(fwState *fws, fwFile *fw) {
+    struct stat sb;
+
+    if (stat(fw->name, &sb) == 0 && sb.st_dev == fw->dev &&
+        sb.st_ino == fw->ino && fw->wd != -1) {
+        return;
+    }
+
+    if (fwFileWatch(fws, fw) == -1) {
+        fwFileGone(fws, fw);
+        fwFileChanged(fws, fw, FW_EVT_DELETE);
+        fwLoopEmit(fws, fw, FW_EVT_DELETE);
+        return;
+    }
+    fw->deleted = 0;
+    fwFileRefresh(fws, fw);
+    fwFileChanged(fws, fw, FW_EVT_WATCH);
+    fwLoopEmit(fws, fw, FW_EVT_WATCH);
+}
+
+static void fwListener(fwState *fws, int fd, void *data, int type) {
+    fwFile *fw = (fwFile *)data;
+
+    if (fws->replaying) {
+        return;
+    }
+
+    if (type & (FW_EVT_DELETE | FW_EVT_WATCH | FW_EVT_MOVE)) {
+        if (access(fw->name, F_OK) == -1 && errno == ENOENT) {
+            fwFileGone(fws, fw);
+            return;
+        } else if (type & (FW_EVT_DELETE | FW_EVT_MOVE)) {
+            /* The watch went with the old inode, follow the name */
+            if (fwFileWatch(fws, fw) == -1) {
+                fwFileGone(fws, fw);
+                return;
+            }
+        }
+        fwFileRefresh(fws, fw);
+    }
+}
+
+/* Watch 'file_name', returning the file it is known as. A name for an inode
+ * that is already watched, say from a root and a directory inside of it,
+ * returns the file that watches it. NULL on error */
+static fwFile *fwFileAdd(fwState *ws, const char *file_name) {
+    char abspath[PATH_MAX], *slash;
+    fwFile **files, *fw;
+    struct stat sb;
+    int id;
+
+    if (ws->files_count >= ws->files_mem_capacity) {
+        files = realloc(ws->files_array,
+                        (ws->files_mem_capacity * 2) * sizeof(fwFile *));
+        if (files == NULL) {
+            return NULL;
+        }
+        ws->files_array = files;
+        ws->files_mem_capacity *= 2;
+    }
+
+    /* Get the absolute filepath of the file on disk */
+    if (realpath(file_name, abspath) == NULL || stat(abspath, &sb) == -1) {
+        fwDebug("CANNOT OPEN FILE: %s - %s\n", file_name, strerror(errno));
+        return NULL;
+    }
+
+    /* A directory is watched for what appears in it, see fwDirWatch */
+    if (S_ISDIR(sb.st_mode)) {
+        return NULL;
+    }
+
+    if ((id = fwNamesFind(ws, &ws->file_names, fwFileName, abspath)) != -1) {
+        fw = ws->files_array[id];
+        if (fw->wd == -1 && fwFileWatch(ws, fw) == 0) {
+            fw->deleted = 0;
+        }
+        return fw;
+    }
+
+    if ((id = fwIdMapGet(&ws->file_inodes, sb.st_dev, sb.st_ino)) != -1) {
+        fwFileSettle(ws, ws->files_array[id]);
+        if (fwIdMapGet(&ws->file_inodes, sb.st_dev, sb.st_ino) == id) {
+            return ws->files_array[id];
+        }
+    }
+
+    /* Allocated individually so the pointer handed to the loop stays valid
+     * when files_array grows */
+    if ((fw = malloc(sizeof(fwFile))) == NULL) {
+        return NULL;
+    }
+
+    fw->fd = -1;
+    fw->wd = -1;
+    fw->dev = sb.st_dev;
+    fw->ino = sb.st_ino;
+    fw->id = ws->files_count;
+    fw->last_update = statFileUpdated(sb);
+    fw->size = sb.st_size;
+    fw->name = strdup(abspath);
+    fw->changed_at = 0;
+    fw->changed_mask = 0;
+    fw->deleted = 0;
+    fw->older = fw->newer = NULL;
+    fw->blocks = NULL;
+    fw->dep_file = -1;
+
+    if (fw->name == NULL) {
+        free(fw);
+        return NULL;
+    }
+
+    ws->files_array[ws->files_count] = fw;
+    if (fwNamesAdd(ws, &ws->file_names, fwFileName, fw->id) == -1) {
+        free(fw->name);
+        free(fw);
+        return NULL;
+    }
+    ws->files_count++;
+
+    /* So it is noticed when the name comes back after a delete or rename,
+     * also when it cannot be watched now */
+    slash = strrchr(abspath, '/');
+    *(slash == abspath ? slash + 1 : slash) = '\0';
+    if (fwDirWatch(ws, abspath, 0, NULL, 0) == NULL) {
+        fwWarn("Cannot watch the directory of: %s\n", fw->name);
+    }
+
+    /* Kept even if it cannot be watched, its directory may bring it back */
+    if (fwFileWatch(ws, fw) == -1) {
+        fw->deleted = 1;
+        return NULL;
+    }
+
+    fwBlocksAttach(ws, fw);
+    return fw;
+}
+
+int fwAddFile(fwState *ws, char *file_name) {
+    return fwFileAdd(ws, file_name) ? 0 : -1;
+}
+
+static int fwHasExt(const char *name, const char *ext, int extlen) {
+    size_t len = strlen(name);
+    return ext == NULL ||
+           (len >= extlen && !memcmp(name + len - extlen, ext, extlen));
+}
+
+static void fwDirListener(fwState *fws, int fd, void *data, int type);
+
+/* Watch what is at 'dir->path' now */
+static void fwDirOpen(fwState *fws, fwDir *dir) {
+    int fd;
+
+    if ((fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        return;
+    }
+    if ((dir->wd = fwLoopAddWatch(fws, fd, FW_EVT_CREATE, fwDirListener,
+                                  dir)) == FW_EVT_ERR) {
+        fwWarn("Cannot watch directory: %s\n", dir->path);
+        close(fd);
+        dir->wd = -1;
+        return;
+    }
+#if defined(IS_BSD)
+    dir->fd = fd;
+#endif
+}
+
+typedef int fwDirVisitor(char *dirname, void *data);
+static int fwWalkDirectories(char *dirname, fwDirVisitor *visit, void *data);
+
+/* Watch the directory at the absolute path 'path' for names appearing in
+ * it, once however many files live in it. 'flags' are added to those it
+ * already has, with FW_DIR_FILES new files ending in 'ext' are added */
+static fwDir *fwDirWatch(fwState *fws, const char *path, int flags,
+                         char *ext, int extlen) {
+    fwDir **dirs, *dir;
+    int id;
+
+    if ((id = fwNamesFind(fws, &fws->dir_names, fwDirName, path)) != -1) {
+        dir = fws->dirs[id];
+        /* The widest filter wins */
+        if ((flags & FW_DIR_FILES) && (!(dir->flags & FW_DIR_FILES) ||
+                                       (dir->ext && ext == NULL))) {
+            free(dir->ext);
+            dir->ext = ext ? strndup(ext, extlen) : NULL;
+            dir->extlen = extlen;
+        }
+        dir->flags |= flags;
+        /* Deleted and created again since, the old watch went with it */
+        if (dir->wd == -1) {
+            fwDirOpen(fws, dir);
+        }
+        return dir;
+    }
+
+    if ((dirs = realloc(fws->dirs, sizeof(fwDir *) * (fws->dirs_count + 1))) ==
+        NULL) {
+        return NULL;
+    }
+    fws->dirs = dirs;
+
+    if ((dir = calloc(1, sizeof(fwDir))) == NULL) {
+        return NULL;
+    }
+    if ((dir->path = strdup(path)) == NULL) {
+        free(dir);
+        return NULL;
+    }
+    dir->id = fws->dirs_count;
+    dir->fd = -1;
+    dir->wd = -1;
+    dir->flags = flags;
+    dir->ext = ext && (flags & FW_DIR_FILES) ? strndup(ext, extlen) : NULL;
+    dir->extlen = extlen;
+    fws->dirs[dir->id] = dir;
+
+    if (fwNamesAdd(fws, &fws->dir_names, fwDirName, dir->id) == -1) {
+        free(dir->ext);
+        free(dir->path);
+        free(dir);
+        return NULL;
+    }
+    fws->dirs_count++;
+
+    /* Without a watch the directory is still known, so it is not retried
+     * for every file in it */
+    fwDirOpen(fws, dir);
+    return dir;
+}
+
+/* 'name' appeared in 'dir'. A file known by that name is watched again,
+ * anything else is added if the directory takes new files or .d files */
+static void fwDirAppeared(fwState *fws, fwDir *dir, const char *name) {
+    char path[PATH_MAX];
+    int id, before;
+    struct stat sb;
+    fwFile *fw;
+
+    if (snprintf(path, sizeof(path), "%s/%s",
+                 strcmp(dir->path, "/") ? dir->path : "", name) >=
+        sizeof(path)) {
+        return;
+    }
+
+    if ((id = fwNamesFind(fws, &fws->file_names, fwFileName, path)) != -1) {
+        fw = fws->files_array[id];
+        /* Also when it exists, a rename over it replaced the inode */
+        if (fwFileWatch(fws, fw) == -1) {
+            return;
+        }
+        fw->deleted = 0;
+        fwFileRefresh(fws, fw);
+        fwFileChanged(fws, fw, FW_EVT_CREATE);
+        fwLoopEmit(fws, fw, FW_EVT_CREATE);
+        return;
+    }
+
+    if (!(dir->flags & (FW_DIR_FILES | FW_DIR_DEPS)) ||
+        stat(path, &sb) == -1) {
+        return;
+    }
+
+    before = fws->files_count;
+    if (dir->flags & FW_DIR_DEPS) {
+        if (S_ISDIR(sb.st_mode)) {
+            fwWalkDirectories(path, fwDepsVisit, fws);
+        } else if (S_ISREG(sb.st_mode) && fwHasExt(name, ".d", 2) &&
+                   fwDepsAddFile(fws, path) == -1) {
+            fwWarn("Cannot load dependencies: %s\n", path);
+        }
+    }
+    if ((dir->flags & FW_DIR_FILES) && S_ISDIR(sb.st_mode) &&
+        (dir->flags & FW_DIR_TREE)) {
+        /* Whatever was created in it before it was watched is new too */
+        fwAddTree(fws, path, dir->ext, dir->extlen);
+    } else if ((dir->flags & FW_DIR_FILES) && S_ISREG(sb.st_mode) &&
+               fwHasExt(name, dir->ext, dir->extlen)) {
+        fwFileAdd(fws, path);
+    }
+
+    for (id = before; id < fws->files_count; ++id) {
+        fw = fws->files_array[id];
+        fwJobsMark(fws, fw);
+        fwFileChanged(fws, fw, FW_EVT_CREATE);
+        fwLoopEmit(fws, fw, FW_EVT_CREATE);
+    }
+}
+
+/* kqueue only says that the directory was written to, look for files that
+ * lost their watch and, if it takes new ones, names not yet known */
+static void fwDirScan(fwState *fws, fwDir *dir) {
+    char path[PATH_MAX];
+    struct dirent *dr;
+    DIR *dp;
+    int id;
+
+    if ((dp = opendir(dir->path)) == NULL) {
+        return;
+    }
+
+    while ((dr = readdir(dp)) != NULL) {
+        if (!strcmp(dr->d_name, ".") || !strcmp(dr->d_name, "..") ||
+            snprintf(path, sizeof(path), "%s/%s",
+                     strcmp(dir->path, "/") ? dir->path : "",
+                     dr->d_name) >= sizeof(path)) {
+            continue;
+        }
+        id = fwNamesFind(fws, &fws->file_names, fwFileName, path);
+        if (id != -1 ? fws->files_array[id]->wd == -1
+                     : (dir->flags & (FW_DIR_FILES | FW_DIR_DEPS)) &&
+                               fwNamesFind(fws, &fws->dir_names, fwDirName,
+                                           path) == -1) {
+            fwDirAppeared(fws, dir, dr->d_name);
+        }
+    }
+    closedir(dp);
+}
+
+static void fwDirListener(fwState *fws, int fd, void *data, int type) {
+    fwDir *dir = data;
+
+    if (fws->replaying) {
+        return;
+    }
+
+    if (fws->event == NULL || *fws->event->name == '\0') {
+        if (type & FW_EVT_DELETE) {
+            fwLoopDeleteEvent(fws, fd, FW_EVT_CREATE);
+            if (dir->fd != -1) {
+                close(dir->fd);
+                dir->fd = -1;
+            }
+            dir->wd = -1;
+        } else {
+            fwDirScan(fws, dir);
+        }
+        return;
+    }
+    fwDirAppeared(fws, dir, fws->event->name);
+}
+
+/* Add multiple files to the watch state */
+void fwAddFiles(fwState *ws, int argc, ...) {
+    va_list ap;
+    char *file_name;
+    va_start(ap, argc);
+    for (int i = 0; i < argc; ++i) {
+        file_name = va_arg(ap, char *);
+        if (fwAddFile(ws, file_name) != 0) {
+            break;
+        }
+    }
+    va_end(ap);
+}
+
+/* Every file in 'dirname' ending in 'ext', and those created later. Files
+ * that cannot be watched are skipped */
+static int fwDirAdd(fwState *ws, char *dirname, char *ext, int extlen,
+                    int flags) {
+    char abspath[PATH_MAX], full_path[PATH_MAX];
+    struct dirent *dr;
+    DIR *dir;
+
+    if (realpath(dirname, abspath) == NULL ||
+        (dir = opendir(abspath)) == NULL) {
+        return -1;
+    }
+
+    /* Watched first so nothing created while reading it is missed */
+    if (fwDirWatch(ws, abspath, flags, ext, extlen) == NULL) {
+        closedir(dir);
+        return -1;
+    }
+
+    while ((dr = readdir(dir)) != NULL) {
+        if (dr->d_type != DT_REG || !fwHasExt(dr->d_name, ext, extlen)) {
+            continue;
+        }
+        if (snprintf(full_path, sizeof(full_path), "%s/%s",
+                     strcmp(abspath, "/") ? abspath : "",
+                     dr->d_name) >= sizeof(full_path)) {
+            fwWarn("Path too long: %s/%s\n", abspath, dr->d_name);
+            continue;
+        }
+        fwDebug("ADDING : %s\n ", full_path);
+        fwFileAdd(ws, full_path);
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* Add a directory, this is not recursive */
+int fwAddDirectory(fwState *ws, char *dirname, char *ext, int extlen) {
+    return fwDirAdd(ws, dirname, ext, extlen, FW_DIR_FILES);
+}
+
+typedef struct fwTreeArgs {
+    fwState *fws;
+    fwShardGroup *fsg;
+    char *ext;
+    int extlen;
+} fwTreeArgs;
+
+/* Call 'visit' for 'dirname' and every directory beneath it, stops at the
+ * first directory that fails to be visited */
+static int fwWalkDirectories(char *dirname, fwDirVisitor *visit, void *data) {
+    DIR *dir;
+    struct dirent *dr;
+    char full_path[PATH_MAX];
+    int len;
+
+    if (visit(dirname, data) == -1) {
+        return -1;
+    }
+
+    if ((dir = opendir(dirname)) == NULL) {
+        return -1;
+    }
+
+    while ((dr = readdir(dir)) != NULL) {
+        if (dr->d_type != DT_DIR || !strcmp(dr->d_name, ".") ||
+            !strcmp(dr->d_name, "..")) {
+            continue;
+        }
+
+        len = snprintf(full_path, sizeof(full_path), "%s/%s", dirname,
+                       dr->d_name);
+        if (len >= sizeof(full_path)) {
+            fwWarn("Path too long: %s/%s\n", dirname, dr->d_name);
+            continue;
+        }
+        fwWalkDirectories(full_path, visit, data);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int fwTreeVisit(char *dirname, void *data) {
+    fwTreeArgs *args = data;
+    return fwDirAdd(args->fws, dirname, args->ext, args->extlen,
+                    FW_DIR_FILES | FW_DIR_TREE);
+}
+
+/* Add 'dirname' and every directory beneath it, including those created
+ * later */
+int fwAddTree(fwState *ws, char *dirname, char *ext, int extlen) {
+    fwTreeArgs args = {.fws = ws, .ext = ext, .extlen = extlen};
+    return fwWalkDirectories(dirname, fwTreeVisit, &args);
+}
+
+void fwLoopMain(fwState *fws) {
+    /* Run the event loop */
+    while (fws->run_loop) {
+        fwLoopProcessEvents(fws);
+    }
+    /* Nothing will restart the jobs once the loop has stopped */
+    fwJobsStop(fws);
+}
+
+/*============================================================================
+ * SHARDED LOOPS
+ *============================================================================*/
+
+/* Pick the shard for everything directly inside of 'dirname' */
+static fwState *fwShardGroupPick(fwShardGroup *fsg, char *dirname) {
+    char abspath[PATH_MAX];
+
+    if (realpath(dirname, abspath) == NULL) {
+        return NULL;
+    }
+    return fsg->shards[fwHashString(abspath, strlen(abspath)) % fsg->count];
+}
+
+/* Create 'shards' loops each with their own watches, thread and command. If
+ * 'shards' is <= 0 one loop per online cpu is created */
+fwShardGroup *fwShardGroupNew(char *command, int shards, int max_events,
+                              int timeout) {
+    fwShardGroup *fsg;
+
+    if (shards <= 0 && (shards = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+        shards = 1;
+    }
+
+    if ((fsg = malloc(sizeof(fwShardGroup))) == NULL) {
+        return NULL;
+    }
+
+    fsg->count = 0;
+    fsg->shards = calloc(shards, sizeof(fwState *));
+    fsg->threads = calloc(shards, sizeof(pthread_t));
+    if (fsg->shards == NULL || fsg->threads == NULL) {
+        goto error;
+    }
+
+    for (; fsg->count < shards; ++fsg->count) {
+        fwState *fws = fwStateNew(command, max_events, timeout);
+        if (fws == NULL) {
+            goto error;
+        }
+        fsg->shards[fsg->count] = fws;
+    }
+
+    return fsg;
+
+error:
+    fwShardGroupRelease(fsg);
+    return NULL;
+}
+
+int fwShardGroupAddFile(fwShardGroup *fsg, char *file_name) {
+    char abspath[PATH_MAX];
+    char *slash;
+    int dirlen;
+
+    if (realpath(file_name, abspath) == NULL) {
+        return -1;
+    }
+
+    slash = strrchr(abspath, '/');
+    dirlen = slash == abspath ? 1 : slash - abspath;
+    return fwAddFile(
+            fsg->shards[fwHashString(abspath, dirlen) % fsg->count],
+            file_name);
+}
+
+static int fwShardGroupVisit(char *dirname, void *data) {
+    fwTreeArgs *args = data;
+    fwState *fws;
+
+    if ((fws = fwShardGroupPick(args->fsg, dirname)) == NULL) {
+        return -1;
+    }
+    return fwDirAdd(fws, dirname, args->ext, args->extlen,
+                    FW_DIR_FILES | FW_DIR_TREE);
+}
+
+/* Add 'dirname' and every directory beneath it, each directory lands on one
+ * shard so its events are always handled by the same loop. A directory
+ * created later stays on the shard of its parent */
+int fwShardGroupAddTree(fwShardGroup *fsg, char *dirname, char *ext,
+                        int extlen) {
+    fwTreeArgs args = {.fsg = fsg, .ext = ext, .extlen = extlen};
+    return fwWalkDirectories(dirname, fwShardGroupVisit, &args);
+}
+
+static void *fwShardThread(void *data) {
+    fwLoopMain((fwState *)data);
+    return NULL;
+}
+
+/* Run every shard on its own thread until the group is stopped */
+void fwShardGroupMain(fwShardGroup *fsg) {
+    int started;
+
+    for (started = 0; started < fsg->count; ++started) {
+        if (pthread_create(&fsg->threads[started], NULL, fwShardThread,
+                           fsg->shards[started]) != 0) {
+            fwWarn("Failed to start shard: %d\n", started);
+            fwShardGroupStop(fsg);
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(fsg->threads[i], NULL);
+    }
+}
+
+void fwShardGroupStop(fwShardGroup *fsg) {
+    for (int i = 0; i < fsg->count; ++i) {
+        fwLoopStop(fsg->shards[i]);
+    }
+}
+
+void fwShardGroupRelease(fwShardGroup *fsg) {
+    if (fsg) {
+        for (int i = 0; i < fsg->count; ++i) {
+            fwStateRelease(fsg->shards[i]);
+        }
+        free(fsg->shards);
+        free(fsg->threads);
+        free(fsg);
+    }
+}
+
+/*============================================================================
+ * DAEMON
+ *============================================================================*/
+
+/* Longest request line a client can send */
+#define FW_DAEMON_LINE_MAX     4096
+/* Output queued for a client before events are dropped */
+#define FW_DAEMON_OUT_MAX      (64 * 1024)
+#define FW_DAEMON_PATTERNS_MAX 16
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* A line per matching event: "<mask in hex> <path>\n" */
+#define FW_SUB_EVENTS 1
+/* A single "changed\n" for each poll that had a matching event */
+#define FW_SUB_NOTIFY 2
+
+typedef struct fwSub {
+    /* Index into the daemon's roots */
+    int root;
+    /* FW_SUB_* */
+    int mode;
+    int pattern_count;
+    char *patterns[FW_DAEMON_PATTERNS_MAX];
+    struct fwSub *next;
+} fwSub;
+
+typedef struct fwClient {
+    int fd;
+    /* Partial request line */
+    char in[FW_DAEMON_LINE_MAX];
+    int in_len;
+    /* Output waiting for the socket to become writable */
+    char out[FW_DAEMON_OUT_MAX];
+    int out_len;
+    /* Output was dropped, the client is told to rescan once it catches up */
+    int overflowed;
+    fwSub *subs;
+    struct fwClient *next;
+} fwClient;
+
+typedef struct fwDaemon {
+    /* Listening socket */
+    int fd;
+    char *sock_path;
+    /* Absolute paths of every root being watched, each is walked once and
+     * shared by all of the subscriptions to it */
+    char **roots;
+    int roots_count;
+    fwClient *clients;
+    /* Batch subscription id */
+    int sub_id;
+} fwDaemon;
+
+static void fwDaemonClientIo(fwState *fws, int fd, void *data, int mask);
+
+/* 1 if 'path' is 'root' or inside of it */
+static int fwPathUnder(const char *path, const char *root) {
+    size_t len = strlen(root);
+    return !strncmp(path, root, len) && (path[len] == '/' || path[len] == '\0');
+}
+
+static int fwDaemonSend(fwState *fws, fwClient *c, char *buf, int len) {
+    ssize_t written = 0;
+
+    if (c->overflowed) {
+        return -1;
+    }
+
+    if (c->out_len == 0) {
+        if ((written = send(c->fd, buf, len, MSG_NOSIGNAL)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            written = 0;
+        }
+        if (written == len) {
+            return 0;
+        }
+    }
+
+    if (c->out_len + len - written > FW_DAEMON_OUT_MAX) {
+        fwWarn("Client %d is too slow, dropping output\n", c->fd);
+        c->overflowed = 1;
+        return -1;
+    }
+
+    memcpy(c->out + c->out_len, buf + written, len - written);
+    c->out_len += len - written;
+    return fwLoopSetIo(fws, c->fd, FW_IO_READ | FW_IO_WRITE, fwDaemonClientIo,
+                       c);
+}
+
+static void fwDaemonClientFree(fwState *fws, fwClient *c) {
+    fwSub *sub, *next;
+
+    fwLoopSetIo(fws, c->fd, 0, NULL, NULL);
+    close(c->fd);
+    for (sub = c->subs; sub; sub = next) {
+        next = sub->next;
+        for (int i = 0; i < sub->pattern_count; ++i) {
+            free(sub->patterns[i]);
+        }
+        free(sub);
+    }
+    free(c);
+}
+
+static void fwDaemonClientClose(fwState *fws, fwDaemon *d, fwClient *c) {
+    fwClient **cur;
+
+    for (cur = &d->clients; *cur; cur = &(*cur)->next) {
+        if (*cur == c) {
+            *cur = c->next;
+            break;
+        }
+    }
+    fwDaemonClientFree(fws, c);
+}
+
+/* Returns the index of the root, watching it if nothing is yet */
+static int fwDaemonAddRoot(fwState *fws, fwDaemon *d, char *path) {
+    char **roots;
+    int covered = 0;
+
+    for (int i = 0; i < d->roots_count; ++i) {
+        if (!strcmp(d->roots[i], path)) {
+            return i;
+        }
+        covered |= fwPathUnder(path, d->roots[i]);
+    }
+
+    if (!covered && fwAddTree(fws, path, NULL, 0) == -1) {
+        return -1;
+    }
+
+    roots = realloc(d->roots, sizeof(char *) * (d->roots_count + 1));
+    if (roots == NULL) {
+        return -1;
+    }
+    d->roots = roots;
+    d->roots[d->roots_count] = strdup(path);
+    return d->roots_count++;
+}
+
+typedef struct fwSinceArgs {
+    fwDaemon *d;
+    fwClient *c;
+} fwSinceArgs;
+
+static int fwSubMatches(fwDaemon *d, fwSub *sub, const char *path);
+
+static void fwDaemonSendChange(fwState *fws, const char *path,
+                               unsigned long long clock, int mask,
+                               void *data) {
+    fwSinceArgs *args = data;
+    char line[PATH_MAX + 48];
+    fwSub *sub;
+    int len;
+
+    for (sub = args->c->subs; sub; sub = sub->next) {
+        if (fwSubMatches(args->d, sub, path)) {
+            break;
+        }
+    }
+    if (sub == NULL) {
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "%llu %x %s\n", clock, mask, path);
+    fwDaemonSend(fws, args->c, line, len);
+}
+
+static int fwDaemonReply(fwState *fws, fwClient *c, char *str) {
+    return fwDaemonSend(fws, c, str, strlen(str));
+}
+
+/* SINCE <instance>:<clock>, replies with a line per file under the
+ * client's subscriptions changed after 'clock' and finishes with
+ * "CLOCK <instance>:<now>". A clock from another instance, or without one,
+ * cannot be compared with ours so "FRESH" comes first and every change
+ * since we started is listed, the client should rescan what it has */
+static void fwDaemonSince(fwState *fws, fwDaemon *d, fwClient *c,
+                          char *clock) {
+    fwSinceArgs args = {.d = d, .c = c};
+    unsigned long long since = 0;
+    char reply[64], *sep;
+    int len;
+
+    if ((sep = strchr(clock, ':')) != NULL &&
+        strtoull(clock, NULL, 16) == fws->instance) {
+        since = strtoull(sep + 1, NULL, 10);
+    } else {
+        fwDaemonReply(fws, c, "FRESH\n");
+    }
+
+    fwQuerySince(fws, since, fwDaemonSendChange, &args);
+    len = snprintf(reply, sizeof(reply), "CLOCK %llx:%llu\n", fws->instance,
+                   fws->clock);
+    fwDaemonSend(fws, c, reply, len);
+}
+
+/* SUB <root> <events|notify> [pattern ...] or SINCE <instance>:<clock> */
+static void fwDaemonRequest(fwState *fws, fwDaemon *d, fwClient *c,
+                            char *line) {
+    char abspath[PATH_MAX], reply[PATH_MAX + 32];
+    char *save, *cmd, *root, *mode, *pattern;
+    struct stat sb;
+    fwSub *sub;
+    int len;
+
+    cmd = strtok_r(line, " \t", &save);
+    root = strtok_r(NULL, " \t", &save);
+    mode = strtok_r(NULL, " \t", &save);
+
+    if (cmd && !strcmp(cmd, "SINCE") && root) {
+        fwDaemonSince(fws, d, c, root);
+        return;
+    }
+
+    if (cmd == NULL || strcmp(cmd, "SUB") || root == NULL || mode == NULL) {
+        fwDaemonReply(fws, c, "ERR expected: SUB <root> <mode> [pattern...]\n");
+        return;
+    }
+
+    if (realpath(root, abspath) == NULL || stat(abspath, &sb) == -1 ||
+        !S_ISDIR(sb.st_mode)) {
+        len = snprintf(reply, sizeof(reply), "ERR not a directory: %s\n",
+                       root);
+        fwDaemonSend(fws, c, reply, len);
+        return;
+    }
+
+    if ((sub = calloc(1, sizeof(fwSub))) == NULL) {
+        return;
+    }
+
+    if (!strcmp(mode, "events")) {
+        sub->mode = FW_SUB_EVENTS;
+    } else if (!strcmp(mode, "notify")) {
+        sub->mode = FW_SUB_NOTIFY;
+    } else {
+        free(sub);
+        fwDaemonReply(fws, c, "ERR mode must be events or notify\n");
+        return;
+    }
+
+    if ((sub->root = fwDaemonAddRoot(fws, d, abspath)) == -1) {
+        free(sub);
+        fwDaemonReply(fws, c, "ERR failed to watch root\n");
+        return;
+    }
+
+    while ((pattern = strtok_r(NULL, " \t", &save)) != NULL &&
+           sub->pattern_count < FW_DAEMON_PATTERNS_MAX) {
+        sub->patterns[sub->pattern_count++] = strdup(pattern);
+    }
+
+    sub->next = c->subs;
+    c->subs = sub;
+    len = snprintf(reply, sizeof(reply), "OK %s\n", abspath);
+    fwDaemonSend(fws, c, reply, len);
+}
+
+static void fwDaemonClientIo(fwState *fws, int fd, void *data, int mask) {
+    fwDaemon *d = fws->daemon;
+    fwClient *c = data;
+    ssize_t len;
+    char *nl;
+
+    if (mask & FW_IO_WRITE) {
+        if ((len = send(fd, c->out, c->out_len, MSG_NOSIGNAL)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fwDaemonClientClose(fws, d, c);
+                return;
+            }
+            len = 0;
+        }
+        memmove(c->out, c->out + len, c->out_len - len);
+        c->out_len -= len;
+
+        if (c->out_len == 0) {
+            fwLoopSetIo(fws, fd, FW_IO_READ, fwDaemonClientIo, c);
+            if (c->overflowed) {
+                c->overflowed = 0;
+                fwDaemonReply(fws, c, "OVERFLOW\n");
+            }
+        }
+    }
+
+    if (mask & FW_IO_READ) {
+        len = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1, 0);
+        if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            fwDaemonClientClose(fws, d, c);
+            return;
+        } else if (len == -1) {
+            return;
+        }
+        c->in_len += len;
+        c->in[c->in_len] = '\0';
+
+        while ((nl = strchr(c->in, '\n')) != NULL) {
+            *nl = '\0';
+            fwDaemonRequest(fws, d, c, c->in);
+            c->in_len -= nl + 1 - c->in;
+            memmove(c->in, nl + 1, c->in_len + 1);
+        }
+
+        if (c->in_len == sizeof(c->in) - 1) {
+            fwDaemonClientClose(fws, d, c);
+        }
+    }
+}
+
+static void fwDaemonAccept(fwState *fws, int fd, void *data, int mask) {
+    fwDaemon *d = data;
+    fwClient *c;
+    int cfd;
+
+    while ((cfd = accept(fd, NULL, NULL)) != -1) {
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+        fcntl(cfd, F_SETFD, FD_CLOEXEC);
+
+        if ((c = calloc(1, sizeof(fwClient))) == NULL) {
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+
+        if (fwLoopSetIo(fws, cfd, FW_IO_READ, fwDaemonClientIo, c) ==
+            FW_EVT_ERR) {
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->next = d->clients;
+        d->clients = c;
+    }
+}
+
+static int fwSubMatches(fwDaemon *d, fwSub *sub, const char *path) {
+    const char *root = d->roots[sub->root];
+    const char *rel;
+
+    if (!fwPathUnder(path, root)) {
+        return 0;
+    }
+
+    if (sub->pattern_count == 0) {
+        return 1;
+    }
+
+    rel = path + strlen(root) + 1;
+    for (int i = 0; i < sub->pattern_count; ++i) {
+        if (fnmatch(sub->patterns[i], rel, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Fan the events from the single kernel queue out to every subscriber */
+static void fwDaemonOnBatch(fwState *fws, fwBatchEvt *evts, int count,
+                            void *data) {
+    fwDaemon *d = data;
+    fwClient *c, *next;
+    char line[PATH_MAX + 32];
+    const char *path;
+    int len, matched, failed;
+
+    if (fws->replaying) {
+        return;
+    }
+
+    for (c = d->clients; c; c = next) {
+        next = c->next;
+        failed = 0;
+
+        for (fwSub *sub = c->subs; sub && !failed; sub = sub->next) {
+            matched = 0;
+            for (int i = 0; i < count && !failed; ++i) {
+                if ((path = fwLoopGetPath(fws, evts[i].path_id)) == NULL ||
+                    !fwSubMatches(d, sub, path)) {
+                    continue;
+                }
+
+                if (sub->mode == FW_SUB_NOTIFY) {
+                    matched = 1;
+                    break;
+                }
+
+                len = snprintf(line, sizeof(line), "%x %s\n", evts[i].mask,
+                               path);
+                failed = fwDaemonSend(fws, c, line, len) == -1 &&
+                         !c->overflowed;
+            }
+
+            if (matched) {
+                failed = fwDaemonReply(fws, c, "changed\n") == -1 &&
+                         !c->overflowed;
+            }
+        }
+
+        if (failed) {
+            fwDaemonClientClose(fws, d, c);
+        }
+    }
+}
+
+/* Serve subscriptions from a unix socket at 'sock_path', the loop then owns
+ * one watch set per root no matter how many clients subscribe to it */
+/* Remove a socket left behind by a previous run. Anything else at the
+ * path, or a socket a daemon still answers on, is left alone and fails */
+static int fwDaemonStale(const char *sock_path, struct sockaddr_un *addr) {
+    struct stat sb;
+    int fd, rc;
+
+    if (lstat(sock_path, &sb) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(sb.st_mode)) {
+        fwWarn("Not a socket, leaving it: %s\n", sock_path);
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        return -1;
+    }
+    rc = connect(fd, (struct sockaddr *)addr, sizeof(*addr));
+    close(fd);
+    if (rc == 0 || errno != ECONNREFUSED) {
+        fwWarn("Socket is in use: %s\n", sock_path);
+        return -1;
+    }
+    return unlink(sock_path);
+}
+
+int fwDaemonListen(fwState *fws, char *sock_path) {
+    struct sockaddr_un addr;
+    mode_t mask;
+    fwDaemon *d;
+    int fd, rc;
+
+    if (fws->daemon || strlen(sock_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    if (fwDaemonStale(sock_path, &addr) == -1) {
+        close(fd);
+        return -1;
+    }
+    /* Only the user running the daemon may connect, whatever the umask */
+    mask = umask(0177);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc == -1 || listen(fd, 64) == -1) {
+        fwDebug("Failed to listen on %s: %s\n", sock_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((d = calloc(1, sizeof(fwDaemon))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    d->fd = fd;
+    d->sock_path = strdup(sock_path);
+
+    if (fwLoopSetIo(fws, fd, FW_IO_READ, fwDaemonAccept, d) == FW_EVT_ERR ||
+        (d->sub_id = fwLoopSubscribeBatch(fws, fwDaemonOnBatch, d)) ==
+                FW_EVT_ERR) {
+        fwLoopSetIo(fws, fd, 0, NULL, NULL);
+        close(fd);
+        free(d->sock_path);
+        free(d);
+        return -1;
+    }
+
+    fws->daemon = d;
+    return 0;
+}
+
+static void fwDaemonRelease(fwState *fws) {
+    fwDaemon *d = fws->daemon;
+    fwClient *c, *next;
+
+    if (d == NULL) {
+        return;
+    }
+
+    for (c = d->clients; c; c = next) {
+        next = c->next;
+        fwDaemonClientFree(fws, c);
+    }
+
+    fwLoopUnsubscribeBatch(fws, d->sub_id);
+    fwLoopSetIo(fws, d->fd, 0, NULL, NULL);
+    close(d->fd);
+    unlink(d->sock_path);
+    free(d->sock_path);
+    for (int i = 0; i < d->roots_count; ++i) {
+        free(d->roots[i]);
+    }
+    free(d->roots);
+    free(d);
+    fws->daemon = NULL;
+}
+
+/*============================================================================
+ * EVENT OUTPUT
+ *============================================================================*/
+
+/* Records are serialised into chunks that are kept between polls and handed
+ * to a single writev, a record never straddles two chunks */
+#define FW_OUTPUT_CHUNK  (64 * 1024)
+#define FW_OUTPUT_CHUNKS 64
+/* Most runs of changed blocks written for one record */
+#define FW_OUTPUT_RUNS_MAX 256
+/* Worst case for one record, every byte of the path escaped as \u00XX */
+#define FW_OUTPUT_RECORD_MAX(pathlen) \
+    ((pathlen) * 6 + 128 + FW_OUTPUT_RUNS_MAX * 44)
+
+typedef struct fwOutput {
+    int fd;
+    /* FW_OUTPUT_* */
+    int format;
+    /* Sent with MSG_NOSIGNAL, anything else has SIGPIPE blocked around it */
+    int socket;
+    /* Batch subscription id */
+    int sub_id;
+    struct iovec iov[FW_OUTPUT_CHUNKS];
+    /* Chunks allocated, and the one being filled */
+    int chunks;
+    int current;
+    /* The first chunk and byte of it not yet written */
+    int head;
+    size_t head_off;
+    /* Waiting for the fd to take more, through the loop */
+    int waiting;
+    /* Records lost to a reader that fell behind, reported once there is
+     * room again */
+    unsigned long long dropped;
+    /* The reader went away, nothing more is written */
+    int broken;
+    /* Runs of changed blocks of the record being written, kept here as
+     * each loop of a shard group has its own output */
+    size_t runs[FW_OUTPUT_RUNS_MAX][2];
+} fwOutput;
+
+/* The most telling part of a FW_EVT_* mask */
+static const char *fwEvtName(int mask) {
+    if (mask & FW_EVT_DELETE) {
+        return "delete";
+    } else if (mask & FW_EVT_MOVE) {
+        return "move";
+    } else if (mask & FW_EVT_CREATE) {
+        return "create";
+    } else if (mask & FW_EVT_WATCH) {
+        return "modify";
+    } else if (mask & FW_EVT_OPEN) {
+        return "open";
+    } else if (mask & FW_EVT_CLOSE) {
+        return "close";
+    }
+    return "other";
+}
+
+static char *fwPutLe(char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        *p++ = (v >> (i * 8)) & 0xff;
+    }
+    return p;
+}
+
+static char *fwPutJsonString(char *p, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+
+    *p++ = '"';
+    for (const unsigned char *c = (const unsigned char *)str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            *p++ = '\\';
+            *p++ = *c;
+        } else if (*c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[*c >> 4];
+            p[5] = hex[*c & 0xf];
+            p += 6;
+        } else {
+            *p++ = *c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+/* writev that fails with EPIPE rather than raising SIGPIPE, whatever the
+ * application does with the signal */
+static ssize_t fwOutputWritev(fwOutput *out, struct iovec *iov, int iovcnt) {
+    struct timespec zero = {0, 0};
+    sigset_t pipe, old, pending;
+    struct msghdr msg = {0};
+    ssize_t len;
+    int saved;
+
+    if (out->socket) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        return sendmsg(out->fd, &msg, MSG_NOSIGNAL);
+    }
+
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    sigpending(&pending);
+    pthread_sigmask(SIG_BLOCK, &pipe, &old);
+    len = writev(out->fd, iov, iovcnt);
+    /* The SIGPIPE is pending on this thread now, unless one already was */
+    if (len == -1 && errno == EPIPE && !sigismember(&pending, SIGPIPE)) {
+        saved = errno;
+        sigtimedwait(&pipe, NULL, &zero);
+        errno = saved;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return len;
+}
+
+static void fwOutputWritable(fwState *fws, int fd, void *data, int mask);
+
+/* Write as much of the chunks as the fd takes without blocking. What is
+ * left waits for the loop to say the fd is writable, the chunks are only
+ * reused once all of them went out. Returns -1 once the reader is gone */
+static int fwOutputFlush(fwState *fws, fwOutput *out) {
+    struct iovec iovs[FW_OUTPUT_CHUNKS], *iov = iovs;
+    int iovcnt = out->current + 1 - out->head;
+    ssize_t len;
+
+    if (out->broken) {
+        return -1;
+    }
+
+    /* writev moves these along, the chunks stay where they are */
+    memcpy(iovs, out->iov + out->head, sizeof(struct iovec) * iovcnt);
+    iov->iov_base = (char *)iov->iov_base + out->head_off;
+    iov->iov_len -= out->head_off;
+
+    while (iovcnt) {
+        if ((len = fwOutputWritev(out, iov, iovcnt)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                out->broken = 1;
+                if (out->waiting) {
+                    fwLoopSetIo(fws, out->fd, 0, NULL, NULL);
+                    out->waiting = 0;
+                }
+                return -1;
+            }
+            if (!out->waiting &&
+                fwLoopSetIo(fws, out->fd, FW_IO_WRITE, fwOutputWritable,
+                            out) == FW_EVT_OK) {
+                out->waiting = 1;
+            }
+            out->head = iov - iovs + out->head;
+            out->head_off = out->iov[out->head].iov_len - iov->iov_len;
+            return 0;
+        }
+        while (iovcnt && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    for (int i = 0; i <= out->current; ++i) {
+        out->iov[i].iov_len = 0;
+    }
+    out->current = 0;
+    out->head = 0;
+    out->head_off = 0;
+    if (out->waiting) {
+        fwLoopSetIo(fws, out->fd, 0, NULL, NULL);
+        out->waiting = 0;
+    }
+    return 0;
+}
+
+static void fwOutputWritable(fwState *fws, int fd, void *data, int mask) {
+    if (fwOutputFlush(fws, data) == -1) {
+        fwWarn("Failed to write events: %s\n", strerror(errno));
+    }
+}
+
+/* Room for 'need' bytes, moving on to the next chunk or flushing them all
+ * once they are full. NULL when the reader has not taken them yet */
+static char *fwOutputReserve(fwState *fws, fwOutput *out, size_t need) {
+    struct iovec *iov = &out->iov[out->current];
+    char *chunk;
+
+    if (iov->iov_len + need <= FW_OUTPUT_CHUNK) {
+        return (char *)iov->iov_base + iov->iov_len;
+    }
+
+    if (out->current + 1 < out->chunks) {
+        iov++;
+    } else if (out->chunks < FW_OUTPUT_CHUNKS) {
+        if ((chunk = malloc(FW_OUTPUT_CHUNK)) == NULL) {
+            return NULL;
+        }
+        iov++;
+        iov->iov_base = chunk;
+        out->chunks++;
+    } else {
+        if (fwOutputFlush(fws, out) == -1 || out->waiting) {
+            return NULL;
+        }
+        return out->iov[0].iov_base;
+    }
+
+    out->current++;
+    iov->iov_len = 0;
+    return iov->iov_base;
+}
 
-    if (fd > fws->fd_current_max) {
-        fws->fd_current_max = fd;
+/* The runs of changed blocks as [first, count] pairs. Past
+ * FW_OUTPUT_RUNS_MAX the last run covers the rest, so it never claims less
+ * changed than did. Returns how many runs there are */
+static int fwOutputRuns(const uint64_t *dirty, size_t count,
+                        size_t runs[][2]) {
+    size_t b = 0, start;
+    int n = 0;
+
+    while (b < count && n < FW_OUTPUT_RUNS_MAX) {
+        if (!(dirty[b / 64] & (1ull << (b % 64)))) {
+            b++;
+            continue;
+        }
+        start = b;
+        while (b < count && (dirty[b / 64] & (1ull << (b % 64)))) {
+            b++;
+        }
+        if (n == FW_OUTPUT_RUNS_MAX - 1) {
+            for (size_t last = count; last > b; --last) {
+                if (dirty[(last - 1) / 64] & (1ull << ((last - 1) % 64))) {
+                    b = last;
+                    break;
+                }
+            }
+        }
+        runs[n][0] = start;
+        runs[n][1] = b - start;
+        n++;
     }
-    fwDebug("HERE\n");
-    return FW_EVT_OK;
+    return n;
 }
 
-void fwLoopDeleteEvent(fwState *fws, int fd, int mask) {
-    fwEvt *ev;
-    int i;
+/* {"seq":..,"type":"..","path":"..","size":..,"mtime":..}\n with
+ * ,"blocks":[[first,count],...] before the end when 'runs' is not NULL */
+static char *fwOutputJson(char *p, unsigned long long seq, const char *type,
+                          const char *path, long long size, long long mtime,
+                          size_t runs[][2], int nruns) {
+    p += sprintf(p, "{\"seq\":%llu,\"type\":\"%s\",\"path\":", seq, type);
+    p = fwPutJsonString(p, path);
+    p += sprintf(p, ",\"size\":%lld,\"mtime\":%lld", size, mtime);
+    if (runs) {
+        p += sprintf(p, ",\"blocks\":[");
+        for (int i = 0; i < nruns; ++i) {
+            p += sprintf(p, "%s[%zu,%zu]", i ? "," : "", runs[i][0],
+                         runs[i][1]);
+        }
+        *p++ = ']';
+    }
+    memcpy(p, "}\n", 2);
+    return p + 2;
+}
 
-    if (fd >= fws->max_events) {
-        return;
+/* Little endian u32 length of what follows, u64 seq, u32 FW_EVT_* mask,
+ * i64 size, i64 mtime, u32 length of the path and the path without a
+ * terminator, then u32 count of block runs and a u64 first and u64 count
+ * for each */
+static char *fwOutputBinary(char *p, unsigned long long seq, int mask,
+                            const char *path, long long size,
+                            long long mtime, size_t runs[][2], int nruns) {
+    size_t len = strlen(path);
+
+    p = fwPutLe(p, 36 + len + 16 * nruns, 4);
+    p = fwPutLe(p, seq, 8);
+    p = fwPutLe(p, mask, 4);
+    p = fwPutLe(p, size, 8);
+    p = fwPutLe(p, mtime, 8);
+    p = fwPutLe(p, len, 4);
+    memcpy(p, path, len);
+    p = fwPutLe(p + len, nruns, 4);
+    for (int i = 0; i < nruns; ++i) {
+        p = fwPutLe(p, runs[i][0], 8);
+        p = fwPutLe(p, runs[i][1], 8);
     }
+    return p;
+}
 
-    ev = &fws->idle[fd];
+/* Tell the reader how many records it missed, {"overflow":true,...} or a
+ * binary record with a mask of 0 and the count as its size */
+static int fwOutputOverflow(fwState *fws, fwOutput *out) {
+    char *p, *end;
 
-    if (ev->mask == FW_EVT_ADD) {
+    if ((p = fwOutputReserve(fws, out, 64)) == NULL) {
+        return -1;
+    }
+    if (out->format == FW_OUTPUT_NDJSON) {
+        end = p + sprintf(p, "{\"overflow\":true,\"dropped\":%llu}\n",
+                          out->dropped);
+    } else {
+        end = fwOutputBinary(p, 0, 0, "", out->dropped, 0, NULL, 0);
+    }
+    out->iov[out->current].iov_len += end - p;
+    out->dropped = 0;
+    return 0;
+}
+
+/* Size and mtime are what the listener last saw, so no event costs a
+ * syscall before the one writev for the whole batch. A reader that cannot
+ * keep up loses records rather than holding up the loop */
+static void fwOutputOnBatch(fwState *fws, fwBatchEvt *evts, int count,
+                            void *data) {
+    fwOutput *out = data;
+    char path[PATH_MAX * 2];
+    const char *name;
+    fwFile *fw;
+    char *p, *end;
+    int nruns;
+
+    if (fws->replaying || out->broken) {
         return;
     }
 
-    fwLoopStateDelete(fws, fd, mask);
-    ev->mask = ev->mask & (~mask);
-    if (fd == fws->fd_current_max && ev->mask == FW_EVT_ADD) {
-        for (i = fws->fd_current_max - 1; i >= 0; --i) {
-            if (fws->idle[i].mask != FW_EVT_ADD) {
-                break;
-            }
+    for (int i = 0; i < count; ++i) {
+        if (evts[i].path_id == -1 || evts[i].mask == 0) {
+            continue;
+        }
+        fw = fws->files_array[evts[i].path_id];
+        /* Written once its blocks are known */
+        if (fw->blocks && fw->blocks->next < fw->blocks->count) {
+            continue;
+        }
+        name = fw->name;
+        if (*evts[i].name) {
+            snprintf(path, sizeof(path), "%s/%s", fw->name, evts[i].name);
+            name = path;
         }
-        fws->fd_current_max = i;
+
+        if ((out->dropped && fwOutputOverflow(fws, out) == -1) ||
+            (p = fwOutputReserve(fws, out,
+                                 FW_OUTPUT_RECORD_MAX(strlen(name)))) ==
+                    NULL) {
+            out->dropped++;
+            continue;
+        }
+
+        nruns = fw->blocks ? fwOutputRuns(fw->blocks->dirty,
+                                          fw->blocks->count, out->runs)
+                           : 0;
+        if (out->format == FW_OUTPUT_NDJSON) {
+            end = fwOutputJson(p, evts[i].seq, fwEvtName(evts[i].mask), name,
+                               fw->deleted ? 0 : fw->size, fw->last_update,
+                               fw->blocks ? out->runs : NULL, nruns);
+        } else {
+            end = fwOutputBinary(p, evts[i].seq, evts[i].mask, name,
+                                 fw->deleted ? 0 : fw->size,
+                                 fw->last_update, out->runs, nruns);
+        }
+        out->iov[out->current].iov_len += end - p;
     }
-}
 
-/* Kill the child process running the command */
-static void fwSigtermHandler(int sig) {
-    if (child_p != -1) {
-        kill(child_p, SIGTERM);
+    if (!out->waiting && fwOutputFlush(fws, out) == -1) {
+        fwWarn("Failed to write events: %s\n", strerror(errno));
     }
-    exit(EXIT_SUCCESS);
 }
 
-/* The dynamic array for storing file state */
-fwState *fwStateNew(char *command, int max_events, int timeout) {
-    struct sigaction act;
-    fwState *fws;
+/* Write every event to 'fd' as FW_OUTPUT_NDJSON or FW_OUTPUT_BINARY, a fd
+ * of -1 stops. The fd is not closed. A socket or pipe is made non-blocking
+ * so a slow reader cannot stall the loop, it misses records instead */
+int fwSetOutput(fwState *fws, int fd, int format) {
+    fwOutput *out;
+    struct stat sb;
 
-    if ((fws = malloc(sizeof(fwState))) == NULL) {
-        goto error;
+    fwOutputRelease(fws);
+    if (fd == -1) {
+        return 0;
     }
 
-    fws->files_array = NULL;
-    fws->idle = NULL;
-    fws->active = NULL;
-    fws->evt_state = NULL;
+    if (format != FW_OUTPUT_NDJSON && format != FW_OUTPUT_BINARY) {
+        return -1;
+    }
 
-    if ((fws->files_array = malloc(sizeof(fwFile) * 10)) == NULL) {
-        goto error;
+    if ((out = calloc(1, sizeof(fwOutput))) == NULL) {
+        return -1;
     }
+    out->fd = fd;
+    out->format = format;
 
-    if ((fws->idle = malloc(sizeof(fwEvt) * max_events)) == NULL) {
-        goto error;
+    if (fstat(fd, &sb) == 0 && (S_ISSOCK(sb.st_mode) || S_ISFIFO(sb.st_mode))) {
+        out->socket = S_ISSOCK(sb.st_mode);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
     }
 
-    if ((fws->active = malloc(sizeof(fwEvt) * max_events)) == NULL) {
-        goto error;
+    if ((out->iov[0].iov_base = malloc(FW_OUTPUT_CHUNK)) == NULL) {
+        free(out);
+        return -1;
     }
+    out->chunks = 1;
 
-    if ((fws->evt_state = fwLoopStateNew(max_events)) == NULL) {
-        goto error;
+    if ((out->sub_id = fwLoopSubscribeBatch(fws, fwOutputOnBatch, out)) ==
+        FW_EVT_ERR) {
+        free(out->iov[0].iov_base);
+        free(out);
+        return -1;
     }
 
-    fws->files_count = 0;
-    fws->files_mem_capacity = 10;
-    fws->command = strdup(command);
-    fws->max_events = max_events;
-    fws->fd_current_max = -1;
-    fws->poll_timeout = timeout;
-    fws->processed_events = 0;
-    fws->run_loop = 1;
-    act.sa_handler = fwSigtermHandler;
-    act.sa_flags = 0;
-    sigemptyset(&act.sa_mask);
-    sigaction(SIGINT, &act, NULL);
+    fws->output = out;
+    return 0;
+}
 
-    for (int i = 0; i < fws->max_events; ++i) {
-        fws->idle[i].mask = FW_EVT_ADD;
+static void fwOutputRelease(fwState *fws) {
+    fwOutput *out = fws->output;
+
+    if (out == NULL) {
+        return;
     }
-    fwDebug("Pre CREATE LOOP STATE\n");
 
+    fwLoopUnsubscribeBatch(fws, out->sub_id);
+    if (out->waiting) {
+        fwLoopSetIo(fws, out->fd, 0, NULL, NULL);
+    }
+    for (int i = 0; i < out->chunks; ++i) {
+        free(out->iov[i].iov_base);
+    }
+    free(out);
+    fws->output = NULL;
+}
+
+/*============================================================================
+ * DEPENDENCIES
+ *============================================================================*/
 
-    return fws;
+/* Resolve 'path' against 'base' and drop any "." and ".." parts, without
+ * touching the filesystem as a tree has thousands of these */
+static int fwPathClean(const char *base, const char *path, char *out,
+                       size_t size) {
+    char buf[PATH_MAX * 2];
+    char *part, *save;
+    size_t len = 0;
 
-error:
-    fwDebug("Failed to create eventloop\n");
-    if (fws->idle) {
-        free(fws->idle);
+    if (snprintf(buf, sizeof(buf), "%s/%s", *path == '/' ? "" : base,
+                 path) >= sizeof(buf)) {
+        return -1;
     }
-    if (fws->active) {
-        free(fws->active);
+
+    for (part = strtok_r(buf, "/", &save); part;
+         part = strtok_r(NULL, "/", &save)) {
+        if (!strcmp(part, ".")) {
+            continue;
+        } else if (!strcmp(part, "..")) {
+            while (len && out[--len] != '/') {
+            }
+            continue;
+        }
+        if (len + strlen(part) + 2 > size) {
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, part, strlen(part));
+        len += strlen(part);
     }
-    if (fws->evt_state) {
-        free(fws->evt_state);
+
+    if (len == 0) {
+        out[len++] = '/';
     }
-    if (fws) {
-        free(fws);
+    out[len] = '\0';
+    return 0;
+}
+
+static int fwDepsGrowTable(fwDeps *deps) {
+    unsigned int size = deps->table_size ? deps->table_size * 2 : 1024;
+    int *table;
+
+    if ((table = malloc(sizeof(int) * size)) == NULL) {
+        return -1;
     }
+    memset(table, -1, sizeof(int) * size);
 
-    return NULL;
+    for (int id = 0; id < deps->nodes_count; ++id) {
+        char *name = deps->nodes[id].name;
+        unsigned int slot = fwHashString(name, strlen(name)) & (size - 1);
 
+        while (table[slot] != -1) {
+            slot = (slot + 1) & (size - 1);
+        }
+        table[slot] = id;
+    }
 
-    return fws;
+    free(deps->table);
+    deps->table = table;
+    deps->table_size = size;
+    return 0;
 }
 
-/* Destroy the event loop and OS specific event state. Closes all open file 
- * descriptors, names of files and command */
-void fwStateRelease(fwState *fws) {
-    if (fws) {
-        for (int i = 0; i < fws->files_count; ++i) {
-            free(fws->files_array[i].name);
-            close(fws->files_array[i].fd);
+/* Node id for 'name', adding it if 'create' is set. -1 if it is not known */
+static int fwDepsNode(fwDeps *deps, const char *name, int create) {
+    unsigned int slot;
+    fwDepNode *nodes;
+    int id;
+
+    if (deps->table_size) {
+        slot = fwHashString((char *)name, strlen(name)) &
+               (deps->table_size - 1);
+        while ((id = deps->table[slot]) != -1) {
+            if (!strcmp(deps->nodes[id].name, name)) {
+                return id;
+            }
+            slot = (slot + 1) & (deps->table_size - 1);
         }
-        free(fws->files_array);
-        free(fws->command);
-        fwEvtStateRelease(fws);
-        free(fws);
     }
-}
 
-size_t fwLoopGetProcessedEventCount(fwState *fws) {
-    return fws->processed_events;
-}
+    if (!create) {
+        return -1;
+    }
 
-void fwLoopStop(fwState *fws) {
-    fws->run_loop = 0;
+    /* Kept at most half full */
+    if ((deps->nodes_count + 1) * 2 > deps->table_size &&
+        fwDepsGrowTable(deps) == -1) {
+        return -1;
+    }
+
+    if (deps->nodes_count == deps->nodes_cap) {
+        int cap = deps->nodes_cap ? deps->nodes_cap * 2 : 256;
+        if ((nodes = realloc(deps->nodes, sizeof(fwDepNode) * cap)) == NULL) {
+            return -1;
+        }
+        deps->nodes = nodes;
+        deps->nodes_cap = cap;
+    }
+
+    id = deps->nodes_count;
+    memset(&deps->nodes[id], 0, sizeof(fwDepNode));
+    deps->nodes[id].canon = -1;
+    if ((deps->nodes[id].name = strdup(name)) == NULL) {
+        return -1;
+    }
+    deps->nodes_count++;
+
+    slot = fwHashString((char *)name, strlen(name)) & (deps->table_size - 1);
+    while (deps->table[slot] != -1) {
+        slot = (slot + 1) & (deps->table_size - 1);
+    }
+    deps->table[slot] = id;
+    return id;
 }
 
-void fwLoopProcessEvents(fwState *fws) {
-    int eventcount;
+/* Record that 'target' is built from 'dep' on behalf of 'df' */
+static int fwDepsAddEdge(fwDeps *deps, fwDepFile *df, int dep, int target) {
+    fwDepNode *node = &deps->nodes[dep];
+    fwDepEdge *edges;
+    fwDepUse *users;
 
-    if (fws->fd_current_max == -1) {
-        return;
+    if (df->edges_count == df->edges_cap) {
+        int cap = df->edges_cap ? df->edges_cap * 2 : 32;
+        if ((edges = realloc(df->edges, sizeof(fwDepEdge) * cap)) == NULL) {
+            return -1;
+        }
+        df->edges = edges;
+        df->edges_cap = cap;
     }
 
-    if ((eventcount = fwLoopPoll(fws)) == FW_EVT_ERR) {
-        return;
+    if (node->users_count == node->users_cap) {
+        int cap = node->users_cap ? node->users_cap * 2 : 4;
+        if ((users = realloc(node->users, sizeof(fwDepUse) * cap)) == NULL) {
+            return -1;
+        }
+        node->users = users;
+        node->users_cap = cap;
     }
 
-    for (int i = 0; i < eventcount; ++i) {
-        int fd = fws->active[i].fd;
-        fwEvt *ev = &fws->idle[fd];
-        int mask = fws->active[i].mask;
+    node->users[node->users_count].target = target;
+    node->users[node->users_count].file = df - deps->files;
+    node->users[node->users_count].edge = df->edges_count;
+    df->edges[df->edges_count].dep = dep;
+    df->edges[df->edges_count].target = target;
+    df->edges[df->edges_count].use = node->users_count++;
+    df->edges_count++;
+    return 0;
+}
 
-        /* If some kind of event that the user has subscribed to
-         * TODO: maintain user defined flags? Although we make a best effort
-         * to map our flags to the OS types */
-        if (mask) {
-            ev->watch(fws, fd, ev->data, mask);
+/* Take out everything 'df' added. The last use of each node fills the hole
+ * and its edge is pointed at where it went */
+static void fwDepsClear(fwDeps *deps, fwDepFile *df) {
+    for (int i = 0; i < df->edges_count; ++i) {
+        fwDepNode *node = &deps->nodes[df->edges[i].dep];
+        fwDepUse *last = &node->users[--node->users_count];
+        int use = df->edges[i].use;
+
+        node->users[use] = *last;
+        deps->files[last->file].edges[last->edge].use = use;
+    }
+    df->edges_count = 0;
+}
+
+/* Split the next word off a line of make syntax, undoing "\ " and "$$".
+ * Returns NULL at the end of the line */
+static char *fwDepsWord(char **cur) {
+    char *p = *cur, *word, *out;
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '\0') {
+        return NULL;
+    }
+
+    word = out = p;
+    while (*p && *p != ' ' && *p != '\t') {
+        if (p[0] == '\\' && p[1] == ' ') {
+            p++;
+        } else if (p[0] == '$' && p[1] == '$') {
+            p++;
         }
-        fws->processed_events++;
+        *out++ = *p++;
+    }
+    if (*p) {
+        p++;
     }
+    *out = '\0';
+    *cur = p;
+    return word;
 }
 
-static void fwRunCommand(char *command) {
-    /* Kill the previous session if required */
-    if (child_p != -1) {
-        fwDebug("child_p: %d\n", child_p);
-        kill(child_p, SIGTERM);    // Use SIGTERM to allow child to cleanup
-        waitpid(child_p, NULL, 0); // Reap the child process
-        fwDebug("Parent: Child terminated\n");
+/* The node for what 'id' resolves to, as files are watched by their real
+ * path. Looked up once per name, one that does not exist yet is used as
+ * written and looked up again on the next load */
+static int fwDepsCanon(fwDeps *deps, int id) {
+    char real[PATH_MAX];
+    int canon = id;
+
+    if (deps->nodes[id].canon != -1) {
+        return deps->nodes[id].canon;
     }
 
-    if ((child_p = fork()) == 0) {
-        fwDebug("Running command\n");
-        system(command);
-        exit(EXIT_SUCCESS); // Make sure to exit after the system call in child
+    if (realpath(deps->nodes[id].name, real) == NULL) {
+        return id;
+    }
+    if (strcmp(real, deps->nodes[id].name) &&
+        (canon = fwDepsNode(deps, real, 1)) == -1) {
+        return -1;
     }
+    deps->nodes[id].canon = canon;
+    deps->nodes[canon].canon = canon;
+    return canon;
 }
 
-static void fwListener(fwState *fws, int fd, void *data, int type) {
-    fwFile *fw = (fwFile *)data;
-    struct stat sb;
+/* "target ...: dependency ..." with continuation lines already joined. The
+ * empty rules -MP adds for headers are skipped */
+static int fwDepsParseLine(fwDeps *deps, fwDepFile *df, char *line) {
+    int targets_count = 0, cap, *targets;
+    char path[PATH_MAX];
+    char *colon, *cur, *word;
+    int dep;
+
+    /* The first colon that ends a word, so "C:\" is not one */
+    for (colon = line; (colon = strchr(colon, ':')) != NULL; ++colon) {
+        if (colon[1] == '\0' || colon[1] == ' ' || colon[1] == '\t') {
+            break;
+        }
+    }
+    if (colon == NULL) {
+        return 0;
+    }
+    *colon = '\0';
+
+    for (cur = line; (word = fwDepsWord(&cur)) != NULL;) {
+        if (targets_count == deps->targets_cap) {
+            cap = deps->targets_cap ? deps->targets_cap * 2 : 16;
+            if ((targets = realloc(deps->targets, sizeof(int) * cap)) ==
+                NULL) {
+                return -1;
+            }
+            deps->targets = targets;
+            deps->targets_cap = cap;
+        }
+        if ((deps->targets[targets_count] = fwDepsNode(deps, word, 1)) ==
+            -1) {
+            return -1;
+        }
+        targets_count++;
+    }
 
-    if (type & (FW_EVT_DELETE | FW_EVT_WATCH)) {
-        close(fw->fd);
-        if (access(fw->name, F_OK) == -1 && errno == ENOENT) {
-            fwDebug("DELETED: %s\n", fw->name);
-            free(fw->name);
-            free(fw);
-            fwLoopDeleteEvent(fws, fd, FW_EVT_WATCH);
-            return;
-        } else {
-            fwLoopDeleteEvent(fws, fd, FW_EVT_WATCH);
-            fw->fd = open(fw->name, OPEN_FILE_FLAGS, 0644);
-            fwLoopAddEvent(fws, fw->fd, FW_EVT_WATCH, fwListener, fw);
+    for (cur = colon + 1; (word = fwDepsWord(&cur)) != NULL;) {
+        if (fwPathClean(deps->base, word, path, sizeof(path)) == -1) {
+            continue;
+        }
+        if ((dep = fwDepsNode(deps, path, 1)) == -1 ||
+            (dep = fwDepsCanon(deps, dep)) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < targets_count; ++i) {
+            if (fwDepsAddEdge(deps, df, dep, deps->targets[i]) == -1) {
+                return -1;
+            }
         }
+    }
+    return 0;
+}
 
-        if (stat(fw->name, &sb) == -1) {
-            fwWarn("Could not update stats for file: %s\n", fw->name);
-            return;
+/* Replace what the .d file 'fw' added to the index with what it says now,
+ * a missing file just takes its part out */
+static void fwDepsReload(fwState *fws, fwFile *fw) {
+    fwDeps *deps = fws->deps;
+    fwDepFile *df = &deps->files[fw->dep_file];
+    char *buf = NULL, *line, *next, *out;
+    size_t len = 0;
+    FILE *fp;
+
+    fwDepsClear(deps, df);
+    if ((fp = fopen(fw->name, "re")) == NULL) {
+        return;
+    }
+
+    if (getdelim(&buf, &len, '\0', fp) == -1) {
+        free(buf);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+
+    for (line = buf; *line; line = next) {
+        /* Join continuation lines in place */
+        for (next = out = line; *next && *next != '\n'; ++next) {
+            if (next[0] == '\\' && next[1] == '\n') {
+                *out++ = ' ';
+                next++;
+            } else if (next[0] == '\\' && next[1] == '\r' && next[2] == '\n') {
+                *out++ = ' ';
+                next += 2;
+            } else if (*next != '\r') {
+                *out++ = *next;
+            }
+        }
+        if (*next) {
+            next++;
         }
+        *out = '\0';
 
-        fw->size = sb.st_size;
-        fw->last_update = statFileUpdated(sb);
-        fwRunCommand(fws->command);
+        if (fwDepsParseLine(deps, df, line) == -1) {
+            fwWarn("Out of memory loading: %s\n", fw->name);
+            break;
+        }
     }
+    free(buf);
 }
 
-int fwAddFile(fwState *ws, char *file_name) {
-    struct stat sb;
-    int fd;
-    char abspath[1048];
+/* 1 if any target is built from 'fw' */
+static int fwDepsAffects(fwState *fws, fwFile *fw) {
+    int id;
 
-    if (ws->files_count >= ws->max_events) {
-        fwWarn("Trying to add more than: %d files\n", ws->max_events);
-        return -1;
+    if (fws->deps == NULL || (id = fwDepsNode(fws->deps, fw->name, 0)) == -1) {
+        return 0;
     }
+    return fws->deps->nodes[id].users_count > 0;
+}
 
-    if (ws->files_count >= ws->files_mem_capacity) {
-        ws->files_array = realloc(ws->files_array, (ws->files_mem_capacity * 2) * sizeof(fwState));
-        ws->files_mem_capacity *= 2;
+/* Add the targets built from 'path' to the job's list and FW_TARGETS, each
+ * only once per job */
+static void fwDepsCollect(fwState *fws, const char *path,
+                          fwChangedArgs *args) {
+    fwDeps *deps = fws->deps;
+    fwDepNode *node, *target;
+    size_t len;
+    int id;
+
+    if (deps == NULL || (id = fwDepsNode(deps, path, 0)) == -1) {
+        return;
     }
 
-    if ((fd = open(file_name, OPEN_FILE_FLAGS, 0644)) == -1) {
-        fwDebug("CANNOT OPEN FILE: %s - %s\n", file_name, strerror(errno));
-        return -1;
+    node = &deps->nodes[id];
+    for (int i = 0; i < node->users_count; ++i) {
+        target = &deps->nodes[node->users[i].target];
+        if (target->seen == deps->query) {
+            continue;
+        }
+        target->seen = deps->query;
+        args->targets_count++;
+
+        if (args->list) {
+            fprintf(args->list, "%s\n", target->name);
+        }
+
+        if (args->targets == NULL) {
+            continue;
+        }
+        len = strlen(target->name);
+        if (args->targets_len + len + 2 > FW_CHANGED_MAX) {
+            free(args->targets);
+            args->targets = NULL;
+            continue;
+        }
+        if (args->targets_len) {
+            args->targets[args->targets_len++] = ' ';
+        }
+        memcpy(args->targets + args->targets_len, target->name, len + 1);
+        args->targets_len += len;
     }
+}
 
+static int fwDepsAddFile(fwState *fws, char *path) {
+    fwDeps *deps = fws->deps;
+    fwDepFile *files;
+    fwFile *fw;
 
-    if (fstat(fd, &sb) == -1) {
-        fwDebug("Failed to add to fstat: %s\n", strerror(errno));
-        close(fd);
+    if ((fw = fwFileAdd(fws, path)) == NULL) {
         return -1;
     }
+    if (fw->dep_file != -1) {
+        return 0;
+    }
 
-    /* Get the absolute filepath of the file on disk */
-    if (realpath(file_name, abspath) == NULL) {
-        fwDebug("Failed to add to realpath: %s\n", strerror(errno));
-        close(fd);
+    files = realloc(deps->files, sizeof(fwDepFile) * (deps->files_count + 1));
+    if (files == NULL) {
         return -1;
     }
+    deps->files = files;
+    memset(&files[deps->files_count], 0, sizeof(fwDepFile));
+    files[deps->files_count].fw = fw;
+    fw->dep_file = deps->files_count++;
 
-    ws->files_array[ws->files_count].fd = fd;
-    ws->files_array[ws->files_count].last_update = statFileUpdated(sb);
-    ws->files_array[ws->files_count].size = sb.st_size;
-    ws->files_array[ws->files_count].name = strdup(abspath);
+    fwDepsReload(fws, fw);
+    return 0;
+}
 
-    fwEvtState *evt = ws->evt_state;
+static int fwDepsVisit(char *dirname, void *data) {
+    fwState *fws = data;
+    char path[PATH_MAX], abspath[PATH_MAX];
+    struct dirent *dr;
+    size_t len;
+    DIR *dir;
 
-    /* Add the file to the watch list */
-    if (fwLoopAddEvent(ws, ws->files_array[ws->files_count].fd, FW_EVT_WATCH, fwListener, &ws->files_array[ws->files_count]) == FW_EVT_ERR) {
-        fwDebug("Failed to add event: filename=%s fd=%d reason: %s\n", file_name, fd, strerror(errno));
-        exit(1);
+    /* Watched first so a .d file written while reading it is not missed */
+    if (realpath(dirname, abspath) == NULL ||
+        fwDirWatch(fws, abspath, FW_DIR_DEPS, NULL, 0) == NULL ||
+        (dir = opendir(dirname)) == NULL) {
+        return -1;
     }
 
-    ws->files_count++;
-    return 0;
-}
-
-/* Add multiple files to the watch state */
-void fwAddFiles(fwState *ws, int argc, ...) {
-    va_list ap;
-    char *file_name;
-    va_start(ap, argc);
-    for (int i = 0; i < argc; ++i) {
-        file_name = va_arg(ap, char *);
-        if (fwAddFile(ws, file_name) != 0) {
-            break;
+    while ((dr = readdir(dir)) != NULL) {
+        len = strlen(dr->d_name);
+        if (dr->d_type != DT_REG || len < 3 ||
+            strcmp(dr->d_name + len - 2, ".d")) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dirname, dr->d_name) >=
+            sizeof(path)) {
+            continue;
+        }
+        if (fwDepsAddFile(fws, path) == -1) {
+            fwWarn("Cannot load dependencies: %s\n", path);
         }
     }
-    va_end(ap);
+    closedir(dir);
+    return 0;
 }
 
-/* Add a directory, this is not recursive */
-int fwAddDirectory(fwState *ws, char *dirname, char *ext, int extlen) {
-    DIR *dir = opendir(dirname);
-    struct dirent *dr;
+/* Load the .d files gcc and clang write with -MD, either one of them or
+ * every one under a directory. They are watched and reloaded when they
+ * change, and ones that appear under the directory later are loaded too.
+ * Relative paths in them are taken from the current directory,
+ * which is where make runs the compiler from */
+int fwAddDeps(fwState *fws, char *path) {
+    char base[PATH_MAX];
     struct stat sb;
-    int files_open = 0, len = 0, should_add = 0;
-    char full_path[1024];
 
-    if (dir == NULL) {
+    if (stat(path, &sb) == -1) {
         return -1;
     }
 
-    while ((dr = readdir(dir)) != NULL && files_open < ws->max_events) {
-        switch (dr->d_type) {
-        case DT_REG:
-            if (!strlen(dr->d_name) && dr->d_name[0] == '.' ||
-                strlen(dr->d_name) == 2 && dr->d_name[0] == '.' &&
-                        dr->d_name[1] == '.') {
-                continue;
-            }
-
-            should_add = 1;
-            len = snprintf(full_path, sizeof(full_path), "%s/%s", dirname,
-                           dr->d_name);
-            full_path[len] = '\0';
-            if (ext) {
-                for (int i = len - 1, j = extlen - 1; j; --i) {
-                    if (full_path[i] != ext[j]) {
-                        should_add = 0;
-                        break;
-                    }
-                    j--;
-                }
-            }
-            if (should_add) {
-                fwDebug("ADDING : %s\n ", full_path);
-                fwAddFile(ws, full_path);
-            }
-            break;
-        case DT_DIR:
-            fwWarn("Directories not yet supported: %s\n", dr->d_name);
-            break;
-        default:
-            break;
+    if (fws->deps == NULL) {
+        if (getcwd(base, sizeof(base)) == NULL ||
+            (fws->deps = calloc(1, sizeof(fwDeps))) == NULL) {
+            return -1;
         }
+        fws->deps->base = strdup(base);
     }
-    closedir(dir);
-    return 0;
+
+    if (S_ISDIR(sb.st_mode)) {
+        return fwWalkDirectories(path, fwDepsVisit, fws);
+    }
+    return fwDepsAddFile(fws, path);
 }
 
-void fwLoopMain(fwState *fws) {
-    /* Run the event loop */
-    while (fws->run_loop) {
-        fwLoopProcessEvents(fws);
+static void fwDepsRelease(fwDeps *deps) {
+    if (deps == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < deps->nodes_count; ++i) {
+        free(deps->nodes[i].name);
+        free(deps->nodes[i].users);
+    }
+    for (int i = 0; i < deps->files_count; ++i) {
+        free(deps->files[i].edges);
     }
+    free(deps->nodes);
+    free(deps->table);
+    free(deps->files);
+    free(deps->base);
+    free(deps->targets);
+    free(deps);
 }
@@ -2,6 +2,7 @@
 #define FW_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define FW_EVT_ADD    0x002
 #define FW_EVT_READ   0x004
@@ -16,24 +17,150 @@
 #define FW_EVT_ERR -1
 #define FW_EVT_OK  1
 
+/* Kill the running job and start again */
+#define FW_JOB_RESTART  1
+/* Let the running job finish, then run once for everything since */
+#define FW_JOB_QUEUE    2
+/* Start another job alongside any that are running */
+#define FW_JOB_PARALLEL 3
+/* Added to a policy, the job only runs for the targets depending on what
+ * changed, which it gets in FW_TARGETS and on stdin */
+#define FW_JOB_DEPS     0x10
+
+/* Pace of fwLoopReplay */
+#define FW_REPLAY_RECORDED 0
+#define FW_REPLAY_MAX      1
+
+/* Streams of a job's captured output */
+#define FW_STDOUT 0
+#define FW_STDERR 1
+
+/* Granularity of block maps */
+#define FW_BLOCK_SIZE (64 * 1024)
+/* The files are only appended to, so only blocks from the old end onwards
+ * are hashed again */
+#define FW_BLOCKS_APPEND 0x1
+
+/* Formats for fwSetOutput */
+#define FW_OUTPUT_NDJSON 1
+#define FW_OUTPUT_BINARY 2
+
+/* Interest in a filedescriptor served by the loop with fwLoopAddFd */
+#define FW_IO_READ  0x1
+#define FW_IO_WRITE 0x2
+
 typedef struct fwState fwState;
+typedef struct fwShardGroup fwShardGroup;
 
 typedef void fwEvtCallback(fwState *fws, int fd, void *data, int type);
 
+/* One normalised event, batch subscribers get an array of these per poll */
+typedef struct fwBatchEvt {
+    /* Watch the event arrived on */
+    int wd;
+    /* Id of the file added with fwAddFile, -1 for anything else */
+    int path_id;
+    /* FW_EVT_* mask */
+    int mask;
+    /* Pairs up the two halves of a rename, 0 otherwise */
+    unsigned int cookie;
+    /* Name within a watched directory, "" for files. Valid until the next
+     * poll */
+    const char *name;
+    /* Logical clock the event stamped its file with, the value SINCE
+     * takes. 0 when it is not for a file */
+    unsigned long long seq;
+} fwBatchEvt;
+
+/* 'evts' holds every event from one poll with duplicate (wd, mask) pairs
+ * merged, for directory watches the name is part of the pair */
+typedef void fwBatchCallback(fwState *fws, fwBatchEvt *evts, int count,
+                             void *data);
+
+/* One line of a job's captured output, without the newline */
+typedef void fwLineCallback(fwState *fws, int rule_id, int pid, int stream,
+                            const char *line, int len, void *data);
+
+/* A file changed at logical time 'clock', 'mask' is FW_EVT_DELETE if the
+ * file no longer exists */
+typedef void fwQueryCallback(fwState *fws, const char *path,
+                             unsigned long long clock, int mask, void *data);
+
+/* 'mask' has the FW_IO_* that are ready, both on hangup or error */
+typedef void fwIoCallback(fwState *fws, int fd, void *data, int mask);
+
+typedef void fwSignalCallback(fwState *fws, int signo, void *data);
+
 void fwAddFiles(fwState *fws, int argc, ...);
 int fwAddDirectory(fwState *fws, char *dirname, char *ext, int extlen);
 int fwAddFile(fwState *fws, char *file_name);
+int fwAddTree(fwState *fws, char *dirname, char *ext, int extlen);
+int fwAddDeps(fwState *fws, char *path);
 
 fwState *fwStateNew(char *command, int max_open, int timeout);
 void fwStateRelease(fwState *fws);
 
+int fwAddRule(fwState *fws, char *pattern, char *command, int policy);
+int fwSetMaxJobs(fwState *fws, int max_jobs);
+int fwSetCapture(fwState *fws, int ring_size, char *log_path);
+int fwSetQueueLimit(fwState *fws, size_t bytes);
+int fwSetOutput(fwState *fws, int fd, int format);
+int fwAddBlockMap(fwState *fws, char *pattern, int flags);
+const uint64_t *fwLoopGetBlocks(fwState *fws, int path_id, size_t *count);
+void fwSetLineCallback(fwState *fws, fwLineCallback *cb, void *data);
+size_t fwJobGetOutput(fwState *fws, int rule_id, int stream, char *buf,
+                      size_t len, unsigned long long *dropped);
+
 void fwLoopProcessEvents(fwState *fws);
 void fwLoopMain(fwState *fws);
 void fwLoopStop(fwState *fws);
 size_t fwLoopGetProcessedEventCount(fwState *fws);
+const char *fwLoopGetPath(fwState *fws, int path_id);
+
+unsigned long long fwLoopGetClock(fwState *fws);
+unsigned long long fwLoopGetInstance(fwState *fws);
+size_t fwQuerySince(fwState *fws, unsigned long long since,
+                    fwQueryCallback *cb, void *data);
+
+/* Chrome/Perfetto JSON of the spans recorded when built with TRACE=1 */
+int fwTraceExport(char *path);
+
+int fwLoopRecord(fwState *fws, char *trace_path);
+long fwLoopReplay(fwState *fws, char *trace_path, int speed);
+
+int fwLoopSubscribeBatch(fwState *fws, fwBatchCallback *cb, void *data);
+void fwLoopUnsubscribeBatch(fwState *fws, int id);
 
 void fwLoopDeleteEvent(fwState *fws, int fd, int mask);
 int fwLoopAddEvent(fwState *fws, int fd, int mask, fwEvtCallback *cb,
                    void *data);
 
+/* Serve any filedescriptor from the same poll as the watches. Adding it
+ * again replaces the interest and callback, the fd is never closed */
+int fwLoopAddFd(fwState *fws, int fd, int mask, fwIoCallback *cb,
+                void *data);
+void fwLoopDelFd(fwState *fws, int fd);
+
+/* Read 'signo' through the loop instead of a handler. The signal is blocked
+ * in the calling thread, so call it before starting any other threads. A
+ * NULL callback stops the loop, which is what SIGINT and SIGTERM do */
+int fwLoopAddSignal(fwState *fws, int signo, fwSignalCallback *cb,
+                    void *data);
+
+/* Serve subscriptions to roots from a unix socket instead of running a
+ * command, clients send "SUB <root> <events|notify> [pattern ...]\n" or
+ * "SINCE <instance>:<clock>\n" */
+int fwDaemonListen(fwState *fws, char *sock_path);
+
+/* Independent loops on their own threads, files are spread across them by
+ * hashing the directory they live in */
+fwShardGroup *fwShardGroupNew(char *command, int shards, int max_events,
+                              int timeout);
+void fwShardGroupRelease(fwShardGroup *fsg);
+int fwShardGroupAddFile(fwShardGroup *fsg, char *file_name);
+int fwShardGroupAddTree(fwShardGroup *fsg, char *dirname, char *ext,
+                        int extlen);
+void fwShardGroupMain(fwShardGroup *fsg);
+void fwShardGroupStop(fwShardGroup *fsg);
+
 #endif // !FW_H
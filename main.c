@@ -1,7 +1,331 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "fw.h"
 
-int main(void) {
-    fwState *fws = fwStateNew("python3 ./example.py", 256, -1);
-    fwAddFile(fws, "./example.py");
-    fwLoopMain(fws);
+#define RULES_MAX 16
+
+static void usage(char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c command] [-j jobs] [-r rule] [-C bytes] [-L log] "
+            "[-t trace] [-R trace] [-B trace] [-T json] [-m watches] "
+            "[-Q bytes] [-o format] [-O socket] [-b pattern] [-a pattern] "
+            "[-D deps] [-d socket] [file ...]\n"
+            "  -c  command to run when any file changes, also with -r\n"
+            "  -j  how many commands may run at once\n"
+            "  -r  '<pattern> <restart|queue|parallel> <command>', run\n"
+            "      command when a file matching pattern changes\n"
+            "  -C  capture command output, keeping the last bytes of each\n"
+            "  -L  capture command output, also copying it to a log file\n"
+            "  -t  record filesystem events into a trace\n"
+            "  -R  replay a trace at the pace it was recorded and exit\n"
+            "  -B  replay a trace as fast as possible, report throughput\n"
+            "  -T  write tracing spans as Chrome trace JSON on exit, needs\n"
+            "      a build with TRACE=1\n"
+            "  -m  watches to start with and events read per poll, grows\n"
+            "  -Q  memory for events waiting to be handled, more spill to\n"
+            "      disk\n"
+            "  -o  write events to stdout as ndjson or binary instead of\n"
+            "      running a command\n"
+            "  -O  write the events to a unix socket instead of stdout\n"
+            "  -b  hash 64KiB blocks of files matching pattern, -o ndjson\n"
+            "      then lists the blocks that changed\n"
+            "  -a  like -b for files that are only ever appended to\n"
+            "  -D  .d file or directory of them, commands then only run\n"
+            "      for the targets built from what changed, in FW_TARGETS\n"
+            "  -d  run as a daemon serving subscriptions on a unix socket\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/* Captured output is shown a line at a time, tagged with the job */
+static void printLine(fwState *fws, int rule_id, int pid, int stream,
+                      const char *line, int len, void *data) {
+    fprintf(stream == FW_STDERR ? stderr : stdout, "[%d] %.*s\n", pid, len,
+            line);
+}
+
+/* Replay a trace instead of watching, the same files have to be given in
+ * the same order as when it was recorded */
+static int replay(fwState *fws, char *trace_path, int speed) {
+    struct timespec start, end;
+    double secs;
+    long events;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((events = fwLoopReplay(fws, trace_path, speed)) == -1) {
+        fprintf(stderr, "Failed to replay: %s\n", trace_path);
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Replayed %ld events in %.6fs (%.0f events/s)\n", events,
+            secs, secs > 0 ? events / secs : 0);
+    return EXIT_SUCCESS;
+}
+
+/* Where -O sends events */
+static int connectSocket(char *sock_path) {
+    struct sockaddr_un addr = {0};
+    int fd;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* '<pattern> <policy> <command>', 'flags' are added to the policy */
+static int addRule(fwState *fws, char *rule, int flags) {
+    char *pattern, *policy, *command, *save;
+    int p;
+
+    pattern = strtok_r(rule, " ", &save);
+    policy = strtok_r(NULL, " ", &save);
+    command = save;
+
+    if (pattern == NULL || policy == NULL || *command == '\0') {
+        return -1;
+    }
+
+    if (!strcmp(policy, "restart")) {
+        p = FW_JOB_RESTART;
+    } else if (!strcmp(policy, "queue")) {
+        p = FW_JOB_QUEUE;
+    } else if (!strcmp(policy, "parallel")) {
+        p = FW_JOB_PARALLEL;
+    } else {
+        return -1;
+    }
+
+    return fwAddRule(fws, pattern, command, p | flags);
+}
+
+int main(int argc, char **argv) {
+    char *command = "python3 ./example.py";
+    int command_set = 0;
+    char *sock_path = NULL;
+    char *log_path = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    char *spans_path = NULL;
+    char *output_path = NULL;
+    int output_format = 0;
+    int output_fd = STDOUT_FILENO;
+    int status = EXIT_SUCCESS;
+    int replay_speed = FW_REPLAY_RECORDED;
+    int capture_size = 0;
+    long queue_size = 0;
+    char *rules[RULES_MAX];
+    int rules_count = 0;
+    char *deps[RULES_MAX];
+    int deps_count = 0;
+    char *blocks[RULES_MAX];
+    int blocks_flags[RULES_MAX];
+    int blocks_count = 0;
+    int max_events = 256;
+    int max_jobs = 1;
+    fwState *fws;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:j:r:C:L:t:R:B:T:m:Q:o:O:b:a:D:d:")) != -1) {
+        switch (opt) {
+        case 'c':
+            command = optarg;
+            command_set = 1;
+            break;
+        case 'j':
+            max_jobs = atoi(optarg);
+            break;
+        case 'r':
+            if (rules_count == RULES_MAX) {
+                usage(argv[0]);
+            }
+            rules[rules_count++] = optarg;
+            break;
+        case 'C':
+            capture_size = atoi(optarg);
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 't':
+            record_path = optarg;
+            break;
+        case 'R':
+            replay_path = optarg;
+            replay_speed = FW_REPLAY_RECORDED;
+            break;
+        case 'B':
+            replay_path = optarg;
+            replay_speed = FW_REPLAY_MAX;
+            break;
+        case 'T':
+            spans_path = optarg;
+            break;
+        case 'm':
+            max_events = atoi(optarg);
+            break;
+        case 'Q':
+            queue_size = atol(optarg);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "ndjson")) {
+                output_format = FW_OUTPUT_NDJSON;
+            } else if (!strcmp(optarg, "binary")) {
+                output_format = FW_OUTPUT_BINARY;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'O':
+            output_path = optarg;
+            break;
+        case 'b':
+        case 'a':
+            if (blocks_count == RULES_MAX) {
+                usage(argv[0]);
+            }
+            blocks_flags[blocks_count] = opt == 'a' ? FW_BLOCKS_APPEND : 0;
+            blocks[blocks_count++] = optarg;
+            break;
+        case 'D':
+            if (deps_count == RULES_MAX) {
+                usage(argv[0]);
+            }
+            deps[deps_count++] = optarg;
+            break;
+        case 'd':
+            sock_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (output_path && output_format == 0) {
+        output_format = FW_OUTPUT_NDJSON;
+    }
+
+    /* A daemon only serves its subscribers and writing events out replaces
+     * the command, so a -c there would never run */
+    if (command_set && (sock_path || output_format)) {
+        fprintf(stderr, "-c cannot be used with -d, -o or -O\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Rules replace the default command, one given with -c runs for every
+     * file next to them */
+    if (sock_path || output_format || (rules_count && !command_set)) {
+        command = NULL;
+    }
+
+    /* The command is added below as a rule that uses the dependencies */
+    if ((fws = fwStateNew(deps_count ? NULL : command, max_events, -1)) ==
+        NULL) {
+        fprintf(stderr, "Failed to create watcher\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < deps_count; ++i) {
+        if (fwAddDeps(fws, deps[i]) == -1) {
+            fprintf(stderr, "Failed to load dependencies: %s\n", deps[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (deps_count && command &&
+        fwAddRule(fws, NULL, command, FW_JOB_RESTART | FW_JOB_DEPS) == -1) {
+        fprintf(stderr, "Failed to add command\n");
+        return EXIT_FAILURE;
+    }
+
+    if (fwSetMaxJobs(fws, max_jobs) == -1) {
+        usage(argv[0]);
+    }
+
+    if (queue_size && fwSetQueueLimit(fws, queue_size) == -1) {
+        usage(argv[0]);
+    }
+
+    if (output_path && (output_fd = connectSocket(output_path)) == -1) {
+        fprintf(stderr, "Failed to connect to: %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    if (output_format && fwSetOutput(fws, output_fd, output_format) == -1) {
+        fprintf(stderr, "Failed to write events\n");
+        return EXIT_FAILURE;
+    }
+
+    if (capture_size || log_path) {
+        if (fwSetCapture(fws, capture_size, log_path) == -1) {
+            fprintf(stderr, "Failed to capture output\n");
+            return EXIT_FAILURE;
+        }
+        fwSetLineCallback(fws, printLine, NULL);
+    }
+
+    for (int i = 0; i < rules_count; ++i) {
+        if (addRule(fws, rules[i], deps_count ? FW_JOB_DEPS : 0) == -1) {
+            fprintf(stderr, "Invalid rule: %s\n", rules[i]);
+            usage(argv[0]);
+        }
+    }
+
+    for (int i = 0; i < blocks_count; ++i) {
+        if (fwAddBlockMap(fws, blocks[i], blocks_flags[i]) == -1) {
+            fprintf(stderr, "Failed to add block map: %s\n", blocks[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sock_path) {
+        if (fwDaemonListen(fws, sock_path) == -1) {
+            fprintf(stderr, "Failed to listen on: %s\n", sock_path);
+            return EXIT_FAILURE;
+        }
+    } else if (optind == argc) {
+        if (fwAddFile(fws, "./example.py") == -1) {
+            fprintf(stderr, "Failed to watch: ./example.py\n");
+        }
+    } else {
+        for (int i = optind; i < argc; ++i) {
+            if (fwAddFile(fws, argv[i]) == -1) {
+                fprintf(stderr, "Failed to watch: %s\n", argv[i]);
+            }
+        }
+    }
+
+    if (replay_path) {
+        status = replay(fws, replay_path, replay_speed);
+    } else {
+        if (record_path && fwLoopRecord(fws, record_path) == -1) {
+            fprintf(stderr, "Failed to record to: %s\n", record_path);
+            return EXIT_FAILURE;
+        }
+        fwLoopMain(fws);
+    }
+    fwStateRelease(fws);
+
+    if (spans_path && fwTraceExport(spans_path) == -1) {
+        fprintf(stderr, "Failed to export spans, was it built with TRACE=1?\n");
+        status = EXIT_FAILURE;
+    }
+    return status;
 }
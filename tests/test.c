@@ -0,0 +1,1311 @@
+/* Drives the watcher against files in a scratch directory, run with
+ * make test. Each test prints its name and the checks that failed */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw.h"
+
+/* How long to wait for an event that should arrive */
+#define WAIT_MS 2000
+/* Poll timeout of every loop, so waits can give up */
+#define POLL_MS 20
+
+#define CHECK(cond)                                                      \
+    do {                                                                 \
+        if (!(cond)) {                                                   \
+            fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                  \
+        }                                                                \
+    } while (0)
+
+static int failures = 0;
+static char scratch[PATH_MAX];
+
+/* Events seen by the batch subscriber since the last reset */
+#define SEEN_MAX 256
+
+typedef struct seenEvt {
+    char path[PATH_MAX];
+    int mask;
+} seenEvt;
+
+typedef struct seenLog {
+    seenEvt evts[SEEN_MAX];
+    int count;
+} seenLog;
+
+static void onBatch(fwState *fws, fwBatchEvt *evts, int count, void *data) {
+    seenLog *log = data;
+    const char *path;
+
+    for (int i = 0; i < count && log->count < SEEN_MAX; ++i) {
+        if ((path = fwLoopGetPath(fws, evts[i].path_id)) == NULL) {
+            continue;
+        }
+        snprintf(log->evts[log->count].path, PATH_MAX, "%s", path);
+        log->evts[log->count].mask = evts[i].mask;
+        log->count++;
+    }
+}
+
+static long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int seen(seenLog *log, const char *path) {
+    for (int i = 0; i < log->count; ++i) {
+        if (!strcmp(log->evts[i].path, path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run the loop until an event for 'path' is seen or WAIT_MS passes */
+static int waitFor(fwState *fws, seenLog *log, const char *path) {
+    long deadline = nowMs() + WAIT_MS;
+
+    while (!seen(log, path) && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    return seen(log, path);
+}
+
+/* Run the loop for 'ms', for whatever is still on its way */
+static void settle(fwState *fws, int ms) {
+    long deadline = nowMs() + ms;
+
+    while (nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+}
+
+static void scratchPath(char *buf, const char *name) {
+    snprintf(buf, PATH_MAX, "%s/%s", scratch, name);
+}
+
+static void writeFile(const char *path, const char *text) {
+    FILE *fp = fopen(path, "a");
+    fputs(text, fp);
+    fclose(fp);
+}
+
+static void replaceFile(const char *path, const char *text) {
+    char tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    fputs(text, fp);
+    fclose(fp);
+    rename(tmp, path);
+}
+
+/* A file renamed away and back keeps being watched */
+static void testRenameBack(void) {
+    char f[PATH_MAX], g[PATH_MAX];
+    seenLog log = {0};
+    fwState *fws;
+
+    scratchPath(f, "rename-f");
+    scratchPath(g, "rename-g");
+    writeFile(f, "a\n");
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+
+    rename(f, g);
+    settle(fws, 100);
+    rename(g, f);
+    settle(fws, 100);
+
+    log.count = 0;
+    writeFile(f, "b\n");
+    CHECK(waitFor(fws, &log, f));
+    fwStateRelease(fws);
+}
+
+/* Replacing a file over and over hands out far more wds than -m, the watch
+ * still follows the name */
+static void testWatchChurn(void) {
+    char f[PATH_MAX], text[32];
+    seenLog log = {0};
+    fwState *fws;
+
+    scratchPath(f, "churn");
+    writeFile(f, "a\n");
+
+    fws = fwStateNew(NULL, 4, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+
+    for (int i = 0; i < 32; ++i) {
+        log.count = 0;
+        snprintf(text, sizeof(text), "%d\n", i);
+        replaceFile(f, text);
+        CHECK(waitFor(fws, &log, f));
+    }
+
+    log.count = 0;
+    writeFile(f, "end\n");
+    CHECK(waitFor(fws, &log, f));
+    fwStateRelease(fws);
+}
+
+/* Adding something that is not there fails rather than exiting */
+static void testAddMissing(void) {
+    char f[PATH_MAX];
+    fwState *fws = fwStateNew(NULL, 16, POLL_MS);
+
+    scratchPath(f, "missing");
+    CHECK(fwAddFile(fws, f) == -1);
+    CHECK(fwAddFile(fws, scratch) == -1);
+    fwStateRelease(fws);
+}
+
+static void *runLoop(void *data) {
+    fwLoopMain(data);
+    return NULL;
+}
+
+/* One SIGINT sent to the process stops every loop, not only the one that
+ * happened to read it */
+static void testSignalFanOut(void) {
+    fwState *a = fwStateNew(NULL, 16, -1);
+    fwState *b = fwStateNew(NULL, 16, -1);
+    pthread_t ta, tb;
+
+    pthread_create(&ta, NULL, runLoop, a);
+    pthread_create(&tb, NULL, runLoop, b);
+    usleep(50 * 1000);
+    kill(getpid(), SIGINT);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+    fwStateRelease(a);
+    fwStateRelease(b);
+}
+
+static int countPaths(fwState *fws) {
+    int count = 0;
+
+    while (fwLoopGetPath(fws, count) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+/* More files than -m are watched, -m is only where the tables start */
+static void testManyFiles(void) {
+    char f[PATH_MAX], name[32];
+    seenLog log = {0};
+    fwState *fws;
+
+    fws = fwStateNew(NULL, 4, POLL_MS);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+    for (int i = 0; i < 20; ++i) {
+        snprintf(name, sizeof(name), "many-%d", i);
+        scratchPath(f, name);
+        writeFile(f, "a\n");
+        CHECK(fwAddFile(fws, f) == 0);
+    }
+    CHECK(countPaths(fws) == 20);
+
+    writeFile(f, "b\n");
+    CHECK(waitFor(fws, &log, f));
+    fwStateRelease(fws);
+}
+
+/* Files and directories created under a tree after it was added */
+static void testTreeCreate(void) {
+    char root[PATH_MAX], sub[PATH_MAX], f[PATH_MAX], g[PATH_MAX];
+    seenLog log = {0};
+    fwState *fws;
+
+    scratchPath(root, "tree");
+    scratchPath(sub, "tree/sub");
+    scratchPath(f, "tree/new");
+    scratchPath(g, "tree/sub/deep");
+    mkdir(root, 0755);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddTree(fws, root, NULL, 0) == 0);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+
+    writeFile(f, "a\n");
+    CHECK(waitFor(fws, &log, f));
+
+    mkdir(sub, 0755);
+    settle(fws, 100);
+    writeFile(g, "a\n");
+    CHECK(waitFor(fws, &log, g));
+
+    log.count = 0;
+    writeFile(g, "b\n");
+    CHECK(waitFor(fws, &log, g));
+    fwStateRelease(fws);
+}
+
+/* A root added after one inside of it, or a second link to a file, does not
+ * watch the same file twice */
+static void testNoDuplicates(void) {
+    char root[PATH_MAX], inner[PATH_MAX], f[PATH_MAX], g[PATH_MAX];
+    fwState *fws;
+
+    scratchPath(root, "dup");
+    scratchPath(inner, "dup/inner");
+    scratchPath(f, "dup/inner/a");
+    scratchPath(g, "dup/b");
+    mkdir(root, 0755);
+    mkdir(inner, 0755);
+    writeFile(f, "a\n");
+    link(f, g);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddTree(fws, inner, NULL, 0) == 0);
+    CHECK(fwAddTree(fws, root, NULL, 0) == 0);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(countPaths(fws) == 1);
+    fwStateRelease(fws);
+}
+
+static int connectTo(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Run the loop and read what the daemon sends to 'fd' into 'buf' until a
+ * line starting with 'until' arrives or WAIT_MS passes. With a NULL 'until'
+ * it only drains for a while */
+static int readReply(fwState *fws, int fd, char *buf, size_t size,
+                     const char *until) {
+    long deadline = nowMs() + (until ? WAIT_MS : 200);
+    size_t len = 0;
+    ssize_t got;
+    char *line;
+
+    buf[0] = '\0';
+    while (nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+        while ((got = recv(fd, buf + len, size - len - 1, 0)) > 0) {
+            len += got;
+            buf[len] = '\0';
+        }
+        if (until && (line = strstr(buf, until)) != NULL &&
+            (line == buf || line[-1] == '\n') && strchr(line, '\n')) {
+            return 1;
+        }
+    }
+    return until == NULL;
+}
+
+static void sendLine(int fd, const char *fmt, const char *arg) {
+    char line[PATH_MAX + 64];
+    int len = snprintf(line, sizeof(line), fmt, arg);
+    (void)write(fd, line, len);
+}
+
+/* SINCE only lists what the client subscribed to, and a clock from another
+ * instance is answered with FRESH */
+static void testSince(void) {
+    char root[PATH_MAX], f[PATH_MAX], out[PATH_MAX], sock[PATH_MAX];
+    char buf[16384], token[64];
+    fwState *fws;
+    int fd;
+
+    scratchPath(root, "since");
+    scratchPath(f, "since/a");
+    scratchPath(out, "since-out");
+    scratchPath(sock, "since.sock");
+    mkdir(root, 0755);
+    writeFile(f, "a\n");
+    writeFile(out, "a\n");
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, out) == 0);
+    CHECK(fwDaemonListen(fws, sock) == 0);
+    CHECK((fd = connectTo(sock)) != -1);
+
+    sendLine(fd, "SUB %s events\n", root);
+    CHECK(readReply(fws, fd, buf, sizeof(buf), "OK "));
+
+    writeFile(f, "b\n");
+    writeFile(out, "b\n");
+    readReply(fws, fd, buf, sizeof(buf), NULL);
+
+    sendLine(fd, "SINCE %s\n", "0:0");
+    CHECK(readReply(fws, fd, buf, sizeof(buf), "CLOCK "));
+    CHECK(!strncmp(buf, "FRESH\n", 6));
+    CHECK(strstr(buf, f) != NULL);
+    CHECK(strstr(buf, out) == NULL);
+
+    sscanf(strstr(buf, "CLOCK ") + 6, "%63s", token);
+    CHECK(strchr(token, ':') != NULL);
+    sendLine(fd, "SINCE %s\n", token);
+    CHECK(readReply(fws, fd, buf, sizeof(buf), "CLOCK "));
+    CHECK(strstr(buf, "FRESH") == NULL);
+    CHECK(strstr(buf, f) == NULL);
+
+    close(fd);
+    fwStateRelease(fws);
+}
+
+/* Too many changes for FW_CHANGED leave it out, and say so */
+static void testChangedTruncated(void) {
+    char dir[PATH_MAX], f[PATH_MAX], out[PATH_MAX], cmd[PATH_MAX * 2];
+    char part[201], text[16] = "";
+    long deadline;
+    fwState *fws;
+    FILE *fp;
+
+    /* Long paths, so a few files are enough */
+    memset(part, 'd', sizeof(part) - 1);
+    part[sizeof(part) - 1] = '\0';
+    scratchPath(dir, "changed");
+    mkdir(dir, 0755);
+    for (int i = 0; i < 15; ++i) {
+        strcat(dir, "/");
+        strcat(dir, part);
+        mkdir(dir, 0755);
+    }
+    scratchPath(out, "changed-flag");
+    snprintf(cmd, sizeof(cmd),
+             "printf %%s \"${FW_CHANGED_TRUNCATED:-0}\" >> %s", out);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    for (int i = 0; i < 40; ++i) {
+        snprintf(f, sizeof(f), "%s/%02d", dir, i);
+        writeFile(f, "a\n");
+        CHECK(fwAddFile(fws, f) == 0);
+    }
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_QUEUE) != -1);
+
+    for (int i = 0; i < 40; ++i) {
+        snprintf(f, sizeof(f), "%s/%02d", dir, i);
+        writeFile(f, "b\n");
+    }
+
+    deadline = nowMs() + WAIT_MS;
+    while (strchr(text, '1') == NULL && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+        if ((fp = fopen(out, "r")) != NULL) {
+            text[fread(text, 1, sizeof(text) - 1, fp)] = '\0';
+            fclose(fp);
+        }
+    }
+    CHECK(strchr(text, '1') != NULL);
+    fwStateRelease(fws);
+}
+
+static int countLines(const char *path) {
+    FILE *fp = fopen(path, "r");
+    int lines = 0, ch;
+
+    if (fp == NULL) {
+        return 0;
+    }
+    while ((ch = fgetc(fp)) != EOF) {
+        lines += ch == '\n';
+    }
+    fclose(fp);
+    return lines;
+}
+
+/* Restarting a job that ignores SIGTERM neither blocks the loop nor starts
+ * the next one before SIGKILL gets rid of it */
+static void testRestartKill(void) {
+    char f[PATH_MAX], out[PATH_MAX], mark[PATH_MAX], cmd[PATH_MAX * 3];
+    long deadline, slowest = 0, took;
+    fwState *fws;
+
+    scratchPath(f, "restart");
+    scratchPath(out, "restart-out");
+    scratchPath(mark, "restart-mark");
+    writeFile(f, "a\n");
+    snprintf(cmd, sizeof(cmd),
+             "if [ ! -e %s ]; then trap '' TERM; touch %s; fi; "
+             "echo start >> %s; sleep 30",
+             mark, mark, out);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_RESTART) != -1);
+
+    writeFile(f, "b\n");
+    deadline = nowMs() + WAIT_MS;
+    while (countLines(out) < 1 && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    CHECK(countLines(out) == 1);
+
+    writeFile(f, "c\n");
+    settle(fws, 500);
+    CHECK(countLines(out) == 1);
+
+    deadline = nowMs() + 3000 + WAIT_MS;
+    while (countLines(out) < 2 && nowMs() < deadline) {
+        took = nowMs();
+        fwLoopProcessEvents(fws);
+        took = nowMs() - took;
+        slowest = took > slowest ? took : slowest;
+    }
+    CHECK(countLines(out) == 2);
+    CHECK(slowest < 500);
+    fwStateRelease(fws);
+}
+
+/* Replaying a trace reaches batch subscribers but runs no jobs and leaves
+ * the watches as they were */
+static void testReplay(void) {
+    char f[PATH_MAX], g[PATH_MAX], out[PATH_MAX], trace[PATH_MAX];
+    char cmd[PATH_MAX * 2];
+    seenLog log = {0};
+    fwState *fws;
+
+    scratchPath(f, "replay-f");
+    scratchPath(g, "replay-g");
+    scratchPath(out, "replay-out");
+    scratchPath(trace, "replay.trace");
+    writeFile(f, "a\n");
+    writeFile(g, "a\n");
+    snprintf(cmd, sizeof(cmd), "echo ran >> %s", out);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddFile(fws, g) == 0);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+    CHECK(fwLoopRecord(fws, trace) == 0);
+    writeFile(f, "b\n");
+    replaceFile(g, "b\n");
+    CHECK(waitFor(fws, &log, f));
+    CHECK(waitFor(fws, &log, g));
+    settle(fws, 100);
+    fwLoopRecord(fws, NULL);
+    fwStateRelease(fws);
+
+    log.count = 0;
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddFile(fws, g) == 0);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_QUEUE) != -1);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+    CHECK(fwLoopReplay(fws, trace, FW_REPLAY_MAX) > 0);
+    CHECK(seen(&log, f));
+    CHECK(seen(&log, g));
+    settle(fws, 200);
+    CHECK(countLines(out) == 0);
+
+    /* The watch on g was not replaced by replaying its rename */
+    log.count = 0;
+    writeFile(g, "c\n");
+    CHECK(waitFor(fws, &log, g));
+    fwStateRelease(fws);
+}
+
+/* With TRACE=1 the spans of a batch are linked by a flow from decoding to
+ * the job it started, without it there is nothing to export */
+static void testTraceFlow(void) {
+    char f[PATH_MAX], out[PATH_MAX], json[PATH_MAX], cmd[PATH_MAX * 2];
+    char needle[64], *text, *p;
+    unsigned long long flow;
+    long deadline, size;
+    fwState *fws;
+    FILE *fp;
+    int found = 0;
+
+    scratchPath(f, "flow");
+    scratchPath(out, "flow-out");
+    scratchPath(json, "flow.json");
+#ifndef FW_TRACE
+    CHECK(fwTraceExport(json) == -1);
+    return;
+#endif
+    writeFile(f, "a\n");
+    snprintf(cmd, sizeof(cmd), "echo ran >> %s", out);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_QUEUE) != -1);
+    writeFile(f, "b\n");
+    deadline = nowMs() + WAIT_MS;
+    while (countLines(out) < 1 && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    /* The job span is recorded once it has been reaped */
+    settle(fws, 200);
+    fwStateRelease(fws);
+
+    CHECK(fwTraceExport(json) == 0);
+    CHECK((fp = fopen(json, "r")) != NULL);
+    if (fp == NULL) {
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    text = calloc(1, size + 1);
+    (void)fread(text, 1, size, fp);
+    fclose(fp);
+
+    for (p = text; (p = strstr(p, "\"ph\":\"f\",\"id\":")) != NULL; ++p) {
+        flow = strtoull(p + 14, NULL, 10);
+        snprintf(needle, sizeof(needle), "\"ph\":\"s\",\"id\":%llu,", flow);
+        found |= strstr(text, needle) != NULL;
+    }
+    CHECK(found);
+    free(text);
+}
+
+typedef struct maskLog {
+    int path_id;
+    /* Every mask seen for 'path_id' in one event */
+    int masks[64];
+    int count;
+} maskLog;
+
+static void onMasks(fwState *fws, fwBatchEvt *evts, int count, void *data) {
+    maskLog *log = data;
+
+    for (int i = 0; i < count; ++i) {
+        if (evts[i].path_id == log->path_id && log->count < 64) {
+            log->masks[log->count++] = evts[i].mask;
+        }
+    }
+}
+
+/* A storm past half of -Q folds the changes to a file into one event that
+ * keeps every kind of change, not only the last */
+static void testCoalesce(void) {
+    char f[PATH_MAX], g[PATH_MAX], name[32];
+    maskLog log = {.path_id = 0};
+    int both = 0;
+    fwState *fws;
+
+    fws = fwStateNew(NULL, 64, POLL_MS);
+    CHECK(fwSetQueueLimit(fws, 32 * 1024) == 0);
+    for (int i = 0; i < 64; ++i) {
+        snprintf(name, sizeof(name), "storm-%d", i);
+        scratchPath(f, name);
+        writeFile(f, "a\n");
+        CHECK(fwAddFile(fws, f) == 0);
+    }
+    fwLoopSubscribeBatch(fws, onMasks, &log);
+
+    /* Round robin, the kernel already folds repeats of the last event */
+    for (int round = 0; round < 40; ++round) {
+        for (int i = 0; i < 64; ++i) {
+            snprintf(name, sizeof(name), "storm-%d", i);
+            scratchPath(f, name);
+            writeFile(f, "b\n");
+        }
+    }
+    scratchPath(f, "storm-0");
+    scratchPath(g, "storm-moved");
+    rename(f, g);
+
+    settle(fws, 300);
+    for (int i = 0; i < log.count; ++i) {
+        both |= (log.masks[i] & FW_EVT_WATCH) && (log.masks[i] & FW_EVT_MOVE);
+    }
+    CHECK(both);
+    fwStateRelease(fws);
+}
+
+/* Clock each event on one file stamped, to match against -o */
+typedef struct seqLog {
+    int path_id;
+    unsigned long long seqs[64];
+    int count;
+} seqLog;
+
+static void onSeqs(fwState *fws, fwBatchEvt *evts, int count, void *data) {
+    seqLog *log = data;
+
+    for (int i = 0; i < count; ++i) {
+        if (evts[i].path_id == log->path_id && log->count < 64) {
+            log->seqs[log->count++] = evts[i].seq;
+        }
+    }
+}
+
+static size_t drain(int fd, char *buf, size_t len) {
+    size_t used = 0;
+    ssize_t n;
+
+    while (used + 1 < len && (n = read(fd, buf + used, len - 1 - used)) > 0) {
+        used += n;
+    }
+    buf[used] = '\0';
+    return used;
+}
+
+/* Records carry the clock SINCE uses, and a socket that is not read or has
+ * gone away neither stalls nor kills the loop */
+static void testOutput(void) {
+    char f[PATH_MAX], name[32], needle[64];
+    static char buf[1 << 20];
+    seqLog log = {.path_id = 0};
+    int sv[2], pv[2], found = 1, flags;
+    long start;
+    fwState *fws;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    flags = fcntl(sv[1], F_GETFL);
+    fcntl(sv[1], F_SETFL, flags | O_NONBLOCK);
+
+    fws = fwStateNew(NULL, 64, POLL_MS);
+    for (int i = 0; i < 64; ++i) {
+        snprintf(name, sizeof(name), "out-%d", i);
+        scratchPath(f, name);
+        writeFile(f, "a\n");
+        CHECK(fwAddFile(fws, f) == 0);
+    }
+    CHECK(fwSetOutput(fws, sv[0], FW_OUTPUT_NDJSON) == 0);
+    fwLoopSubscribeBatch(fws, onSeqs, &log);
+
+    scratchPath(f, "out-0");
+    writeFile(f, "b\n");
+    settle(fws, 100);
+    drain(sv[1], buf, sizeof(buf));
+    CHECK(log.count > 0);
+    for (int i = 0; i < log.count; ++i) {
+        snprintf(needle, sizeof(needle), "{\"seq\":%llu,", log.seqs[i]);
+        found &= strstr(buf, needle) != NULL;
+    }
+    CHECK(found);
+
+    /* Nobody reads, every poll still returns */
+    start = nowMs();
+    for (int round = 0; round < 600; ++round) {
+        for (int i = 0; i < 64; ++i) {
+            snprintf(name, sizeof(name), "out-%d", i);
+            scratchPath(f, name);
+            writeFile(f, "c\n");
+        }
+        fwLoopProcessEvents(fws);
+    }
+    CHECK(nowMs() - start < 30000);
+
+    while (drain(sv[1], buf, sizeof(buf))) {
+        settle(fws, 50);
+    }
+    writeFile(f, "d\n");
+    settle(fws, 100);
+    drain(sv[1], buf, sizeof(buf));
+    CHECK(strstr(buf, "{\"overflow\":true,\"dropped\":") != NULL);
+
+    close(sv[1]);
+    writeFile(f, "e\n");
+    settle(fws, 100);
+
+    /* A pipe with no reader fails with EPIPE rather than SIGPIPE */
+    CHECK(pipe(pv) == 0);
+    close(pv[0]);
+    CHECK(fwSetOutput(fws, pv[1], FW_OUTPUT_BINARY) == 0);
+    writeFile(f, "f\n");
+    settle(fws, 100);
+
+    fwStateRelease(fws);
+    close(sv[0]);
+    close(pv[1]);
+}
+
+/* Copy of the last block bitmap reported for one file */
+typedef struct blockLog {
+    int path_id;
+    uint64_t dirty[64];
+    size_t count;
+    int seen;
+} blockLog;
+
+static void onBlocks(fwState *fws, fwBatchEvt *evts, int count, void *data) {
+    blockLog *log = data;
+    const uint64_t *dirty;
+
+    for (int i = 0; i < count; ++i) {
+        if (evts[i].path_id == log->path_id &&
+            (dirty = fwLoopGetBlocks(fws, log->path_id, &log->count))) {
+            memcpy(log->dirty, dirty, sizeof(uint64_t) * ((log->count + 63) / 64));
+            log->seen = 1;
+        }
+    }
+}
+
+static int countBlocks(blockLog *log) {
+    int n = 0;
+
+    for (size_t b = 0; b < log->count; ++b) {
+        n += (log->dirty[b / 64] >> (b % 64)) & 1;
+    }
+    return n;
+}
+
+static void writeBlock(const char *path, size_t block) {
+    int fd = open(path, O_WRONLY);
+    (void)pwrite(fd, "x", 1, (off_t)block * FW_BLOCK_SIZE);
+    close(fd);
+}
+
+static void makeSparse(const char *path, size_t blocks) {
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    CHECK(ftruncate(fd, (off_t)blocks * FW_BLOCK_SIZE) == 0);
+    close(fd);
+}
+
+/* Only the blocks written to are dirty. A file too large to hash in one go
+ * has the rest compared between polls, and is reported once it is done */
+static void testBlocks(void) {
+    blockLog log = {.path_id = 0}, tail = {.path_id = 1};
+    char f[PATH_MAX], g[PATH_MAX];
+    fwState *fws;
+
+    scratchPath(f, "blocks.bin");
+    scratchPath(g, "blocks.log");
+    makeSparse(f, 1100);
+    makeSparse(g, 10);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddFile(fws, g) == 0);
+    CHECK(fwAddBlockMap(fws, "*.bin", 0) == 0);
+    CHECK(fwAddBlockMap(fws, "*.log", FW_BLOCKS_APPEND) == 0);
+    fwLoopSubscribeBatch(fws, onBlocks, &log);
+    fwLoopSubscribeBatch(fws, onBlocks, &tail);
+    settle(fws, 200);
+
+    /* The tail past the first step is compared too, and stays clean */
+    writeBlock(f, 5);
+    settle(fws, 200);
+    CHECK(log.seen && log.count == 1100);
+    CHECK(countBlocks(&log) == 1 && (log.dirty[0] >> 5) & 1);
+
+    log.seen = 0;
+    writeBlock(f, 1050);
+    settle(fws, 200);
+    CHECK(log.seen && countBlocks(&log) == 1);
+    CHECK((log.dirty[1050 / 64] >> (1050 % 64)) & 1);
+
+    /* Grown past one step, blocks that were never hashed are all new */
+    makeSparse(g, 1500);
+    settle(fws, 500);
+    CHECK(tail.seen && tail.count == 1500);
+    CHECK(countBlocks(&tail) == 1490);
+
+    /* Everything was hashed meanwhile, so only the appended block is new */
+    tail.seen = 0;
+    writeFile(g, "x");
+    settle(fws, 200);
+    CHECK(tail.seen && tail.count == 1501 && countBlocks(&tail) == 1);
+    CHECK((tail.dirty[1500 / 64] >> (1500 % 64)) & 1);
+    fwStateRelease(fws);
+}
+
+/* Run the loop until 'path' has 'lines' lines, then the last one */
+static int waitLine(fwState *fws, const char *path, int lines, char *last,
+                    size_t len) {
+    long deadline = nowMs() + WAIT_MS;
+    FILE *fp;
+
+    while (countLines(path) < lines && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    *last = '\0';
+    if (countLines(path) != lines || (fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(last, len, fp)) {
+    }
+    fclose(fp);
+    last[strcspn(last, "\n")] = '\0';
+    return 1;
+}
+
+/* .d files are reloaded and discovered as the build writes them, headers
+ * match through symlinks, and a .d file taking the targets away keeps a
+ * restart rule from killing its job */
+static void testDeps(void) {
+    char dir[PATH_MAX], src[PATH_MAX], link[PATH_MAX], out[PATH_MAX];
+    char h1[PATH_MAX], h2[PATH_MAX], h3[PATH_MAX], ad[PATH_MAX];
+    char bd[PATH_MAX], cd[PATH_MAX], text[PATH_MAX * 3], cmd[PATH_MAX * 2];
+    fwState *fws;
+
+    scratchPath(dir, "deps");
+    scratchPath(src, "deps-src");
+    scratchPath(link, "deps-link");
+    scratchPath(out, "deps-out");
+    mkdir(dir, 0755);
+    mkdir(src, 0755);
+    CHECK(symlink(src, link) == 0);
+    snprintf(h1, sizeof(h1), "%s/h1.h", src);
+    snprintf(h2, sizeof(h2), "%s/h2.h", src);
+    snprintf(h3, sizeof(h3), "%s/h3.h", src);
+    snprintf(ad, sizeof(ad), "%s/a.d", dir);
+    snprintf(bd, sizeof(bd), "%s/b.d", dir);
+    snprintf(cd, sizeof(cd), "%s/c.d", dir);
+    writeFile(h1, "1\n");
+    writeFile(h2, "2\n");
+    writeFile(h3, "3\n");
+    snprintf(text, sizeof(text), "a.o: %s \\\n %s/h3.h\n", h1, link);
+    writeFile(ad, text);
+    snprintf(text, sizeof(text), "b.o: %s\n", h1);
+    writeFile(bd, text);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddDeps(fws, dir) == 0);
+    CHECK(fwAddFile(fws, h1) == 0);
+    CHECK(fwAddFile(fws, h2) == 0);
+    CHECK(fwAddFile(fws, h3) == 0);
+    snprintf(cmd, sizeof(cmd), "echo $FW_TARGETS >> %s", out);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_QUEUE | FW_JOB_DEPS) != -1);
+
+    writeFile(h3, "x\n");
+    CHECK(waitLine(fws, out, 1, text, sizeof(text)));
+    CHECK(!strcmp(text, "a.o"));
+
+    /* Only what a.d added goes */
+    snprintf(text, sizeof(text), "a.o: %s/h3.h\n", link);
+    replaceFile(ad, text);
+    settle(fws, 100);
+    writeFile(h1, "x\n");
+    CHECK(waitLine(fws, out, 2, text, sizeof(text)));
+    CHECK(!strcmp(text, "b.o"));
+
+    /* Targets past the first 16 of a rule count as well */
+    snprintf(text, sizeof(text),
+             "t1.o t2.o t3.o t4.o t5.o t6.o t7.o t8.o t9.o t10.o t11.o "
+             "t12.o t13.o t14.o t15.o t16.o c.o: %s\n",
+             h2);
+    writeFile(cd, text);
+    settle(fws, 100);
+    writeFile(h2, "x\n");
+    CHECK(waitLine(fws, out, 3, text, sizeof(text)));
+    CHECK(strstr(text, "t1.o") && strstr(text, "c.o"));
+    fwStateRelease(fws);
+
+    scratchPath(out, "deps-restart");
+    snprintf(cmd, sizeof(cmd),
+             "echo start >> %s; sleep 1; echo end >> %s", out, out);
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddDeps(fws, dir) == 0);
+    CHECK(fwAddFile(fws, h1) == 0);
+    CHECK(fwAddFile(fws, h3) == 0);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_RESTART | FW_JOB_DEPS) != -1);
+
+    writeFile(h3, "y\n");
+    CHECK(waitLine(fws, out, 1, text, sizeof(text)));
+
+    /* Marked for b.o, which is gone by the time the rule is scheduled */
+    writeFile(h1, "y\n");
+    snprintf(text, sizeof(text), "b.o: %s\n", h2);
+    replaceFile(bd, text);
+    settle(fws, 1500);
+    CHECK(countLines(out) == 2);
+    CHECK(waitLine(fws, out, 2, text, sizeof(text)));
+    CHECK(!strcmp(text, "end"));
+    fwStateRelease(fws);
+}
+
+/* Largest number of entries one batch had for the same (file, mask) */
+typedef struct mergeLog {
+    int batches;
+    int worst;
+    int both;
+} mergeLog;
+
+static void onMerge(fwState *fws, fwBatchEvt *evts, int count, void *data) {
+    mergeLog *log = data;
+    int seen0 = 0, seen1 = 0, same;
+
+    for (int i = 0; i < count; ++i) {
+        same = 0;
+        for (int k = 0; k < count; ++k) {
+            same += evts[k].path_id == evts[i].path_id &&
+                    evts[k].mask == evts[i].mask;
+        }
+        log->worst = same > log->worst ? same : log->worst;
+        seen0 |= evts[i].path_id == 0;
+        seen1 |= evts[i].path_id == 1;
+    }
+    log->both |= seen0 && seen1;
+    log->batches++;
+}
+
+/* Interleaved writes to two files are not folded by the kernel, the batch
+ * still has one entry per file and kind of change */
+static void testMerge(void) {
+    char f[PATH_MAX], g[PATH_MAX];
+    mergeLog log = {0};
+    fwState *fws;
+
+    scratchPath(f, "merge-a");
+    scratchPath(g, "merge-b");
+    writeFile(f, "a\n");
+    writeFile(g, "a\n");
+
+    fws = fwStateNew(NULL, 64, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddFile(fws, g) == 0);
+    fwLoopSubscribeBatch(fws, onMerge, &log);
+
+    for (int i = 0; i < 8; ++i) {
+        writeFile(f, "b\n");
+        writeFile(g, "b\n");
+    }
+    settle(fws, 200);
+    CHECK(log.both);
+    CHECK(log.worst == 1);
+    fwStateRelease(fws);
+}
+
+/* A subdirectory of a tree that is removed and made again is watched
+ * again, as in rm -rf build; mkdir build */
+static void testTreeRecreate(void) {
+    char root[PATH_MAX], sub[PATH_MAX], f[PATH_MAX], g[PATH_MAX];
+    seenLog log = {0};
+    fwState *fws;
+
+    scratchPath(root, "again");
+    scratchPath(sub, "again/sub");
+    scratchPath(f, "again/sub/old");
+    scratchPath(g, "again/sub/new");
+    mkdir(root, 0755);
+    mkdir(sub, 0755);
+    writeFile(f, "a\n");
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddTree(fws, root, NULL, 0) == 0);
+    fwLoopSubscribeBatch(fws, onBatch, &log);
+
+    unlink(f);
+    rmdir(sub);
+    settle(fws, 100);
+    mkdir(sub, 0755);
+    settle(fws, 100);
+    writeFile(g, "a\n");
+    CHECK(waitFor(fws, &log, g));
+
+    log.count = 0;
+    writeFile(g, "b\n");
+    CHECK(waitFor(fws, &log, g));
+    fwStateRelease(fws);
+}
+
+static void onCreates(fwState *fws, fwBatchEvt *evts, int count,
+                      void *data) {
+    for (int i = 0; i < count; ++i) {
+        *(int *)data += evts[i].path_id != -1 &&
+                        (evts[i].mask & FW_EVT_CREATE);
+    }
+}
+
+/* More new files in one poll than a batch holds still reach subscribers */
+static void testCreateBurst(void) {
+    char root[PATH_MAX], f[PATH_MAX], name[32];
+    int creates = 0;
+    fwState *fws;
+
+    scratchPath(root, "burst");
+    mkdir(root, 0755);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddTree(fws, root, NULL, 0) == 0);
+    fwLoopSubscribeBatch(fws, onCreates, &creates);
+
+    for (int i = 0; i < 3000; ++i) {
+        snprintf(name, sizeof(name), "burst/%d", i);
+        scratchPath(f, name);
+        writeFile(f, "a\n");
+    }
+    settle(fws, 500);
+    CHECK(creates == 3000);
+    fwStateRelease(fws);
+}
+
+/* The daemon only replaces a socket nobody answers on */
+static void testDaemonSocket(void) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char file[PATH_MAX], sock[PATH_MAX];
+    fwState *fws, *other;
+    struct stat sb;
+    int fd;
+
+    scratchPath(file, "victim.txt");
+    scratchPath(sock, "stale.sock");
+    writeFile(file, "keep\n");
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwDaemonListen(fws, file) == -1);
+    CHECK(stat(file, &sb) == 0 && S_ISREG(sb.st_mode));
+
+    /* Bound and closed, as after a crash */
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    close(fd);
+    CHECK(fwDaemonListen(fws, sock) == 0);
+
+    other = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwDaemonListen(other, sock) == -1);
+    fwStateRelease(other);
+    CHECK((fd = connectTo(sock)) != -1);
+    close(fd);
+    fwStateRelease(fws);
+}
+
+/* A job gets its variables from the loop, not ones we were started with */
+static void testJobEnv(void) {
+    char f[PATH_MAX], out[PATH_MAX], cmd[PATH_MAX * 2], line[PATH_MAX * 2];
+    fwState *fws;
+
+    scratchPath(f, "env");
+    scratchPath(out, "env-out");
+    writeFile(f, "a\n");
+    snprintf(cmd, sizeof(cmd),
+             "echo \"${FW_CHANGED_TRUNCATED}-${FW_CHANGED}\" >> %s", out);
+    setenv("FW_CHANGED_TRUNCATED", "1", 1);
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwAddRule(fws, NULL, cmd, FW_JOB_QUEUE) != -1);
+    writeFile(f, "b\n");
+    CHECK(waitLine(fws, out, 1, line, sizeof(line)));
+    CHECK(line[0] == '-' && !strcmp(line + 1, f));
+    fwStateRelease(fws);
+    unsetenv("FW_CHANGED_TRUNCATED");
+}
+
+/* Lines handed to the line callback */
+typedef struct lineLog {
+    char lines[64][64];
+    int streams[64];
+    int count;
+} lineLog;
+
+static void onLine(fwState *fws, int rule_id, int pid, int stream,
+                   const char *line, int len, void *data) {
+    lineLog *log = data;
+
+    if (log->count < 64) {
+        snprintf(log->lines[log->count], 64, "%.*s", len, line);
+        log->streams[log->count++] = stream;
+    }
+}
+
+static int seenLine(lineLog *log, const char *line) {
+    for (int i = 0; i < log->count; ++i) {
+        if (!strcmp(log->lines[i], line)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Output goes to the ring, the line callback and the log all at once. The
+ * ring keeps the tail and counts the rest, lines are framed across reads */
+static void testCapture(void) {
+    char f[PATH_MAX], logpath[PATH_MAX], buf[256];
+    unsigned long long dropped = 0;
+    lineLog lines = {0};
+    long deadline;
+    fwState *fws;
+    size_t len;
+    FILE *fp;
+    int rule;
+
+    scratchPath(f, "capture");
+    scratchPath(logpath, "capture.log");
+    writeFile(f, "a\n");
+
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwAddFile(fws, f) == 0);
+    CHECK(fwSetCapture(fws, 64, logpath) == 0);
+    fwSetLineCallback(fws, onLine, &lines);
+    rule = fwAddRule(fws, NULL,
+                     "printf abc; sleep 0.2; echo def; i=0; "
+                     "while [ $i -lt 20 ]; do echo line$i; i=$((i+1)); "
+                     "done; sleep 0.1; echo err >&2",
+                     FW_JOB_QUEUE);
+    CHECK(rule != -1);
+
+    writeFile(f, "b\n");
+    deadline = nowMs() + WAIT_MS;
+    while (!seenLine(&lines, "err") && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    settle(fws, 100);
+
+    CHECK(lines.count == 22);
+    CHECK(!strcmp(lines.lines[0], "abcdef") && lines.streams[0] == FW_STDOUT);
+    CHECK(seenLine(&lines, "line19"));
+    CHECK(lines.streams[lines.count - 1] == FW_STDERR);
+
+    /* 7 bytes for abcdef, 60 for line0-9 and 70 for line10-19 */
+    len = fwJobGetOutput(fws, rule, FW_STDOUT, buf, sizeof(buf), &dropped);
+    CHECK(len == 64 && dropped == 137 - 64);
+    CHECK(len >= 7 && !memcmp(buf + len - 7, "line19\n", 7));
+    len = fwJobGetOutput(fws, rule, FW_STDERR, buf, sizeof(buf), &dropped);
+    CHECK(len == 4 && dropped == 0 && !memcmp(buf, "err\n", 4));
+    fwStateRelease(fws);
+
+    CHECK((fp = fopen(logpath, "r")) != NULL);
+    len = fp ? fread(buf, 1, sizeof(buf) - 1, fp) : 0;
+    buf[len] = '\0';
+    if (fp) {
+        fclose(fp);
+    }
+    CHECK(len == 137 + 4);
+    CHECK(!strncmp(buf, "abcdef\nline0\n", 13));
+    CHECK(strstr(buf, "line19\nerr\n") != NULL);
+}
+
+/* FW_IO_* masks a callback was handed, one counter per callback */
+typedef struct ioLog {
+    int calls;
+    int mask;
+} ioLog;
+
+static void onIo(fwState *fws, int fd, void *data, int mask) {
+    ioLog *log = data;
+    char byte;
+
+    log->calls++;
+    log->mask |= mask;
+    if (mask & FW_IO_READ) {
+        (void)read(fd, &byte, 1);
+    }
+}
+
+/* A fd served from the loop gets its callback, adding it again swaps the
+ * interest and callback, and deleting it stops them */
+static void testLoopFd(void) {
+    ioLog reads = {0}, writes = {0};
+    fwState *fws;
+    int sv[2];
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fws = fwStateNew(NULL, 16, POLL_MS);
+    CHECK(fwLoopAddFd(fws, sv[0], 0, onIo, &reads) == FW_EVT_ERR);
+    CHECK(fwLoopAddFd(fws, sv[0], FW_IO_READ, NULL, &reads) == FW_EVT_ERR);
+    CHECK(fwLoopAddFd(fws, sv[0], FW_IO_READ, onIo, &reads) == FW_EVT_OK);
+
+    settle(fws, 50);
+    CHECK(reads.calls == 0);
+    (void)write(sv[1], "x", 1);
+    settle(fws, 50);
+    CHECK(reads.calls == 1 && reads.mask == FW_IO_READ);
+
+    /* Writable straight away, and reads no longer reach the old callback */
+    CHECK(fwLoopAddFd(fws, sv[0], FW_IO_WRITE, onIo, &writes) == FW_EVT_OK);
+    (void)write(sv[1], "y", 1);
+    fwLoopProcessEvents(fws);
+    CHECK(writes.calls >= 1 && writes.mask == FW_IO_WRITE);
+    CHECK(reads.calls == 1);
+
+    fwLoopDelFd(fws, sv[0]);
+    writes.calls = 0;
+    settle(fws, 50);
+    CHECK(writes.calls == 0 && reads.calls == 1);
+
+    fwStateRelease(fws);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void onSignal(fwState *fws, int signo, void *data) {
+    *(int *)data = signo;
+}
+
+/* A signal added to the loop reaches its callback on the loop's thread */
+static void testLoopSignal(void) {
+    fwState *fws = fwStateNew(NULL, 16, POLL_MS);
+    long deadline = nowMs() + WAIT_MS;
+    int got = 0;
+
+    CHECK(fwLoopAddSignal(fws, 0, onSignal, &got) == FW_EVT_ERR);
+    CHECK(fwLoopAddSignal(fws, SIGUSR1, onSignal, &got) == FW_EVT_OK);
+    kill(getpid(), SIGUSR1);
+    while (got == 0 && nowMs() < deadline) {
+        fwLoopProcessEvents(fws);
+    }
+    CHECK(got == SIGUSR1);
+    fwStateRelease(fws);
+}
+
+typedef struct testCase {
+    const char *name;
+    void (*fn)(void);
+} testCase;
+
+static testCase tests[] = {
+    {"rename back", testRenameBack},
+    {"watch churn", testWatchChurn},
+    {"add missing", testAddMissing},
+    {"signal fan out", testSignalFanOut},
+    {"many files", testManyFiles},
+    {"tree create", testTreeCreate},
+    {"no duplicates", testNoDuplicates},
+    {"since", testSince},
+    {"changed truncated", testChangedTruncated},
+    {"restart kill", testRestartKill},
+    {"replay", testReplay},
+    {"trace flow", testTraceFlow},
+    {"coalesce", testCoalesce},
+    {"output", testOutput},
+    {"blocks", testBlocks},
+    {"deps", testDeps},
+    {"merge", testMerge},
+    {"tree recreate", testTreeRecreate},
+    {"create burst", testCreateBurst},
+    {"daemon socket", testDaemonSocket},
+    {"job env", testJobEnv},
+    {"capture", testCapture},
+    {"loop fd", testLoopFd},
+    {"loop signal", testLoopSignal},
+};
+
+int main(int argc, char **argv) {
+    char cmd[PATH_MAX + 16];
+    int before;
+
+    snprintf(scratch, sizeof(scratch), "%s/fwtest.XXXXXX",
+             getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (mkdtemp(scratch) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    /* Events carry resolved paths */
+    if (realpath(scratch, cmd) != NULL) {
+        snprintf(scratch, sizeof(scratch), "%s", cmd);
+    }
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        before = failures;
+        tests[i].fn();
+        printf("%s %s\n", failures == before ? "ok  " : "FAIL", tests[i].name);
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch);
+    (void)system(cmd);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw.h"
+#include "trace.h"
+
+#ifdef FW_TRACE
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define fwTraceThreadId() ((long)syscall(SYS_gettid))
+#else
+#define fwTraceThreadId() ((long)pthread_self())
+#endif
+
+/* Spans kept per thread, older spans are overwritten */
+#define FW_TRACE_RING 65536
+
+typedef struct fwSpan {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    long arg;
+    /* 0 when the span is not part of a flow */
+    uint64_t flow;
+    int phase;
+} fwSpan;
+
+/* Only the owning thread writes to a buffer, so recording takes no lock */
+typedef struct fwTraceBuf {
+    long tid;
+    /* Spans ever recorded, the ring holds the last FW_TRACE_RING */
+    uint64_t count;
+    fwSpan spans[FW_TRACE_RING];
+    struct fwTraceBuf *next;
+} fwTraceBuf;
+
+static __thread fwTraceBuf *trace_buf = NULL;
+/* Every thread's buffer, kept after the thread exits for fwTraceExport */
+static fwTraceBuf *trace_bufs = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_flows = 0;
+
+uint64_t fwTraceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Unique across every loop in the process, never 0 */
+uint64_t fwTraceNewFlow(void) {
+    return __atomic_add_fetch(&trace_flows, 1, __ATOMIC_RELAXED);
+}
+
+void fwTraceRecord(const char *name, uint64_t start, uint64_t end, long arg,
+                   uint64_t flow, int phase) {
+    fwTraceBuf *tb = trace_buf;
+    fwSpan *span;
+
+    if (tb == NULL) {
+        if ((tb = calloc(1, sizeof(fwTraceBuf))) == NULL) {
+            return;
+        }
+        tb->tid = fwTraceThreadId();
+        pthread_mutex_lock(&trace_lock);
+        tb->next = trace_bufs;
+        trace_bufs = tb;
+        pthread_mutex_unlock(&trace_lock);
+        trace_buf = tb;
+    }
+
+    span = &tb->spans[tb->count++ % FW_TRACE_RING];
+    span->name = name;
+    span->start = start;
+    span->end = end;
+    span->arg = arg;
+    span->flow = flow;
+    span->phase = phase;
+}
+
+/* Write every recorded span as Chrome trace event JSON, which Perfetto also
+ * reads. Spans in a flow also get a flow event bound to them, so the spans
+ * of one batch are drawn linked. Threads should have stopped recording,
+ * spans being written while exporting may come out torn */
+int fwTraceExport(char *path) {
+    static const char phases[] = {'s', 't', 'f'};
+    uint64_t first, count;
+    fwTraceBuf *tb;
+    int sep = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[");
+    pthread_mutex_lock(&trace_lock);
+    for (tb = trace_bufs; tb; tb = tb->next) {
+        count = tb->count;
+        first = count > FW_TRACE_RING ? count - FW_TRACE_RING : 0;
+        for (uint64_t i = first; i < count; ++i) {
+            fwSpan *span = &tb->spans[i % FW_TRACE_RING];
+            fprintf(fp,
+                    "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":%d,\"tid\":%ld,"
+                    "\"args\":{\"arg\":%ld}}",
+                    sep ? "," : "", span->name, span->start / 1000.0,
+                    (span->end - span->start) / 1000.0, (int)getpid(),
+                    tb->tid, span->arg);
+            if (span->flow) {
+                fprintf(fp,
+                        ",\n{\"name\":\"batch\",\"cat\":\"flow\","
+                        "\"ph\":\"%c\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,"
+                        "\"tid\":%ld,\"bp\":\"e\"}",
+                        phases[span->phase - FW_FLOW_START],
+                        (unsigned long long)span->flow, span->start / 1000.0,
+                        (int)getpid(), tb->tid);
+            }
+            sep = 1;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(fp, "\n]}\n");
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+#else
+
+int fwTraceExport(char *path) {
+    (void)path;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Where a span sits in a flow, the chain of spans one batch of events goes
+ * through from decoding to the job it started */
+#define FW_FLOW_START 1
+#define FW_FLOW_STEP  2
+#define FW_FLOW_END   3
+
+/* Spans are only recorded when built with -DFW_TRACE (make TRACE=1),
+ * otherwise every macro here compiles to nothing */
+#ifdef FW_TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FW_HAVE_SDT (1)
+#endif
+#endif
+
+/* USDT probe fw:<name> with the start, end and argument of the span */
+#ifdef FW_HAVE_SDT
+#define fwTraceProbe(name, start, end, arg) \
+    DTRACE_PROBE3(fw, name, start, end, arg)
+#else
+#define fwTraceProbe(name, start, end, arg)
+#endif
+
+#define fwTraceStart() (fwTraceNow())
+#define fwTraceFlowNew() (fwTraceNewFlow())
+
+#define fwTraceSpan(name, start, arg) fwTraceSpanFlow(name, start, arg, 0, 0)
+
+/* A span that is also part of 'flow', 'phase' is one of FW_FLOW_* */
+#define fwTraceSpanFlow(name, start, arg, flow, phase)                      \
+    do {                                                                    \
+        uint64_t __end = fwTraceNow();                                      \
+        fwTraceRecord(#name, (start), __end, (long)(arg), (flow), (phase)); \
+        fwTraceProbe(name, (start), __end, (long)(arg));                    \
+    } while (0)
+
+uint64_t fwTraceNow(void);
+uint64_t fwTraceNewFlow(void);
+void fwTraceRecord(const char *name, uint64_t start, uint64_t end, long arg,
+                   uint64_t flow, int phase);
+
+#else
+#define fwTraceStart()   (0)
+#define fwTraceFlowNew() (0)
+#define fwTraceSpan(name, start, arg) ((void)(start))
+#define fwTraceSpanFlow(name, start, arg, flow, phase) \
+    ((void)(start), (void)(flow), (void)(phase))
+#endif
+
+#endif // !TRACE_H